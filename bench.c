@@ -0,0 +1,473 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "mfs.h"
+
+// load generator for the server, built on the client library.
+//
+// every worker (a thread inside one of -p processes) opens its own
+// connection and works in its own directory, so workers never contend
+// on names. with -r the load is open loop: each worker has a fixed
+// schedule and latency is measured from when a request was due, not
+// from when it went out, so a stalled server shows up in the tail.
+
+#define MAX_THREADS 256
+#define NAME_LEN 28
+
+typedef struct {
+    char *workload;
+    char *host;
+    int port;
+    int procs;
+    int threads;
+    double duration;  // seconds
+    double rate;      // total ops/s across all workers, 0 = closed loop
+    int io_size;      // bytes per small read/write
+    int seq_size;     // bytes per seqrw read/write
+    int file_size;    // bytes in the rw workloads' file
+    int depth;        // directories in the deep workload
+    int json;
+} config_t;
+
+config_t cfg = {
+    .workload = "mixed",
+    .procs = 1,
+    .threads = 1,
+    .duration = 5,
+    .rate = 0,
+    .io_size = 512,
+    .seq_size = MFS_BLOCK_SIZE,
+    .file_size = 64 * 1024,
+    .depth = 16,
+};
+
+typedef struct {
+    int id;
+    unsigned int seed;
+    int dir;      // this worker's directory
+    int file;     // its data file (rw workloads)
+    int *path;    // inums of the deep workload's chain
+    long meta_ops; // mixed keeps its own creat/lookup/unlink cycle
+    unsigned long long *samples;
+    long nsamples;
+    long cap;
+    long errors;
+    long retransmits;
+} worker_t;
+
+unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void record(worker_t *w, unsigned long long ns, int rc) {
+    if (w->nsamples == w->cap) {
+        w->cap = w->cap == 0 ? 4096 : 2 * w->cap;
+        w->samples = realloc(w->samples, w->cap * sizeof(unsigned long long));
+        assert(w->samples != NULL);
+    }
+    w->samples[w->nsamples++] = ns;
+    if (rc < 0) {
+        w->errors++;
+    }
+}
+
+// ensure a file of cfg.file_size bytes exists in dir and return its inum
+int make_file(int dir, char *name) {
+    if (MFS_Creat(dir, MFS_REGULAR_FILE, name) < 0) {
+        return -1;
+    }
+    int inum = MFS_Lookup(dir, name);
+    if (inum < 0) {
+        return -1;
+    }
+    char buffer[MFS_BLOCK_SIZE];
+    memset(buffer, 'x', sizeof(buffer));
+    for (int offset = 0; offset < cfg.file_size; offset += MFS_BLOCK_SIZE) {
+        int n = cfg.file_size - offset < MFS_BLOCK_SIZE ? cfg.file_size - offset : MFS_BLOCK_SIZE;
+        if (MFS_Write(inum, buffer, offset, n) < 0) {
+            return -1;
+        }
+    }
+    return inum;
+}
+
+int setup(worker_t *w) {
+    char name[NAME_LEN];
+    snprintf(name, NAME_LEN, "bench.%d.%d", getpid(), w->id);
+    if (MFS_Creat(0, MFS_DIRECTORY, name) < 0) {
+        return -1;
+    }
+    w->dir = MFS_Lookup(0, name);
+    if (w->dir < 0) {
+        return -1;
+    }
+
+    if (strcmp(cfg.workload, "smallrw") == 0 || strcmp(cfg.workload, "seqrw") == 0 ||
+        strcmp(cfg.workload, "mixed") == 0) {
+        w->file = make_file(w->dir, "data");
+        if (w->file < 0) {
+            return -1;
+        }
+    }
+
+    if (strcmp(cfg.workload, "deep") == 0) {
+        w->path = malloc(cfg.depth * sizeof(int));
+        int parent = w->dir;
+        for (int i = 0; i < cfg.depth; i++) {
+            snprintf(name, NAME_LEN, "d%d", i);
+            if (MFS_Creat(parent, MFS_DIRECTORY, name) < 0) {
+                return -1;
+            }
+            parent = MFS_Lookup(parent, name);
+            if (parent < 0) {
+                return -1;
+            }
+            w->path[i] = parent;
+        }
+    }
+    return 0;
+}
+
+void cleanup(worker_t *w) {
+    char name[NAME_LEN];
+    if (w->path != NULL) {
+        for (int i = cfg.depth - 1; i >= 0; i--) {
+            snprintf(name, NAME_LEN, "d%d", i);
+            MFS_Unlink(i == 0 ? w->dir : w->path[i - 1], name);
+        }
+        free(w->path);
+    }
+    MFS_Unlink(w->dir, "data");
+    for (int i = 0; i < 8; i++) {
+        snprintf(name, NAME_LEN, "m%d", i);
+        MFS_Unlink(w->dir, name);
+    }
+    snprintf(name, NAME_LEN, "bench.%d.%d", getpid(), w->id);
+    MFS_Unlink(0, name);
+}
+
+// one operation of the workload. returns < 0 on failure. ops are single
+// RPCs except in deep, where an op is one full path walk.
+int op_meta(worker_t *w, long n) {
+    char name[NAME_LEN];
+    snprintf(name, NAME_LEN, "m%ld", (n / 3) % 8);
+    switch (n % 3) {
+    case 0:
+        return MFS_Creat(w->dir, MFS_REGULAR_FILE, name);
+    case 1:
+        return MFS_Lookup(w->dir, name);
+    default:
+        return MFS_Unlink(w->dir, name);
+    }
+}
+
+int op_smallrw(worker_t *w, long n) {
+    char buffer[MFS_BLOCK_SIZE];
+    int offset = rand_r(&w->seed) % (cfg.file_size - cfg.io_size + 1);
+    if (rand_r(&w->seed) % 2 == 0) {
+        return MFS_Read(w->file, buffer, offset, cfg.io_size);
+    }
+    memset(buffer, 'w', cfg.io_size);
+    return MFS_Write(w->file, buffer, offset, cfg.io_size);
+}
+
+int op_seqrw(worker_t *w, long n) {
+    // one pass of writes over the file, then one pass of reads
+    char buffer[MFS_MAX_IO];
+    int chunks = (cfg.file_size + cfg.seq_size - 1) / cfg.seq_size;
+    int b = n % (2 * chunks);
+    int write = b < chunks;
+    int offset = (b % chunks) * cfg.seq_size;
+    int count = cfg.file_size - offset < cfg.seq_size ? cfg.file_size - offset : cfg.seq_size;
+    if (write) {
+        memset(buffer, 's', count);
+        return MFS_Write(w->file, buffer, offset, count);
+    }
+    return MFS_Read(w->file, buffer, offset, count);
+}
+
+int op_deep(worker_t *w, long n) {
+    char name[NAME_LEN];
+    int inum = w->dir;
+    for (int i = 0; i < cfg.depth; i++) {
+        snprintf(name, NAME_LEN, "d%d", i);
+        inum = MFS_Lookup(inum, name);
+        if (inum != w->path[i]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int op_mixed(worker_t *w, long n) {
+    int dice = rand_r(&w->seed) % 10;
+    if (dice < 4) {
+        MFS_Stat_t st;
+        return MFS_Stat(w->file, &st);
+    }
+    if (dice < 7) {
+        char buffer[MFS_BLOCK_SIZE];
+        int offset = rand_r(&w->seed) % (cfg.file_size - cfg.io_size + 1);
+        return MFS_Read(w->file, buffer, offset, cfg.io_size);
+    }
+    if (dice < 9) {
+        return op_smallrw(w, n);
+    }
+    return op_meta(w, w->meta_ops++);
+}
+
+int (*workload_op())(worker_t *, long) {
+    if (strcmp(cfg.workload, "meta") == 0) return op_meta;
+    if (strcmp(cfg.workload, "smallrw") == 0) return op_smallrw;
+    if (strcmp(cfg.workload, "seqrw") == 0) return op_seqrw;
+    if (strcmp(cfg.workload, "deep") == 0) return op_deep;
+    if (strcmp(cfg.workload, "mixed") == 0) return op_mixed;
+    return NULL;
+}
+
+void *run_worker(void *arg) {
+    worker_t *w = (worker_t*)arg;
+    if (MFS_Init(cfg.host, cfg.port) < 0 || setup(w) < 0) {
+        fprintf(stderr, "bench: worker %d: setup failed\n", w->id);
+        w->errors = -1;
+        return NULL;
+    }
+
+    int (*op)(worker_t *, long) = workload_op();
+    int workers = cfg.procs * cfg.threads;
+    unsigned long long interval = cfg.rate > 0 ? (unsigned long long)(1e9 * workers / cfg.rate) : 0;
+    unsigned long long start = now_ns();
+    unsigned long long end = start + (unsigned long long)(cfg.duration * 1e9);
+
+    // stagger open-loop workers so they don't fire in lockstep
+    unsigned long long due = start + (interval * w->id) / workers;
+    for (long n = 0; ; n++) {
+        unsigned long long t = now_ns();
+        if (t >= end) {
+            break;
+        }
+        if (interval > 0) {
+            if (due > t) {
+                struct timespec ts = { (due - t) / 1000000000ULL, (due - t) % 1000000000ULL };
+                nanosleep(&ts, NULL);
+            }
+            // when running behind this charges the wait to the request
+            t = due;
+            due += interval;
+        }
+        int rc = op(w, n);
+        record(w, now_ns() - t, rc);
+    }
+
+    w->retransmits = MFS_Retransmits();
+    cleanup(w);
+    return NULL;
+}
+
+int compare(const void *a, const void *b) {
+    unsigned long long x = *(unsigned long long*)a, y = *(unsigned long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+int write_all(int fd, void *buf, size_t n) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t rc = write(fd, p, n);
+        if (rc <= 0) {
+            return -1;
+        }
+        p += rc;
+        n -= rc;
+    }
+    return 0;
+}
+
+int read_all(int fd, void *buf, size_t n) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t rc = read(fd, p, n);
+        if (rc <= 0) {
+            return -1;
+        }
+        p += rc;
+        n -= rc;
+    }
+    return 0;
+}
+
+// run cfg.threads workers in this process and ship their samples to
+// the parent through fd: errors, retransmits, count, then the samples
+void run_process(int proc, int fd) {
+    pthread_t threads[MAX_THREADS];
+    worker_t workers[MAX_THREADS];
+    memset(workers, 0, sizeof(workers));
+    for (int t = 0; t < cfg.threads; t++) {
+        workers[t].id = proc * cfg.threads + t;
+        workers[t].seed = getpid() * 31 + t;
+        int rc = pthread_create(&threads[t], NULL, run_worker, &workers[t]);
+        assert(rc == 0);
+    }
+    for (int t = 0; t < cfg.threads; t++) {
+        pthread_join(threads[t], NULL);
+        long header[3] = { workers[t].errors, workers[t].retransmits, workers[t].nsamples };
+        if (write_all(fd, header, sizeof(header)) < 0 ||
+            write_all(fd, workers[t].samples, workers[t].nsamples * sizeof(unsigned long long)) < 0) {
+            perror("bench: write");
+            exit(1);
+        }
+        free(workers[t].samples);
+    }
+}
+
+double percentile(unsigned long long *sorted, long n, double q) {
+    if (n == 0) {
+        return 0;
+    }
+    long i = (long)(q * n);
+    if (i >= n) {
+        i = n - 1;
+    }
+    return sorted[i] / 1e3;
+}
+
+void usage() {
+    fprintf(stderr, "usage: bench [options] <host> <port>\n"
+        "  -w <workload>  meta | smallrw | seqrw | deep | mixed (default mixed)\n"
+        "  -p <procs>     client processes (default 1)\n"
+        "  -t <threads>   client threads per process (default 1)\n"
+        "  -d <seconds>   run time (default 5)\n"
+        "  -r <ops/s>     total open-loop request rate (default 0, closed loop)\n"
+        "  -s <bytes>     small read/write size (default 512)\n"
+        "  -B <bytes>     seqrw read/write size (default 4096, more needs a tcp: or unix: host)\n"
+        "  -f <bytes>     file size for the rw workloads (default 65536)\n"
+        "  -D <depth>     directory depth for deep (default 16)\n"
+        "  -j             print results as JSON\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    while ((ch = getopt(argc, argv, "w:p:t:d:r:s:B:f:D:j")) != -1) {
+        switch (ch) {
+        case 'w': cfg.workload = optarg; break;
+        case 'p': cfg.procs = atoi(optarg); break;
+        case 't': cfg.threads = atoi(optarg); break;
+        case 'd': cfg.duration = atof(optarg); break;
+        case 'r': cfg.rate = atof(optarg); break;
+        case 's': cfg.io_size = atoi(optarg); break;
+        case 'B': cfg.seq_size = atoi(optarg); break;
+        case 'f': cfg.file_size = atoi(optarg); break;
+        case 'D': cfg.depth = atoi(optarg); break;
+        case 'j': cfg.json = 1; break;
+        default: usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 2 || workload_op() == NULL) {
+        usage();
+    }
+    cfg.host = argv[0];
+    cfg.port = atoi(argv[1]);
+    if (cfg.procs < 1 || cfg.threads < 1 || cfg.threads > MAX_THREADS || cfg.duration <= 0 ||
+        cfg.io_size <= 0 || cfg.io_size > MFS_BLOCK_SIZE || cfg.file_size < cfg.io_size ||
+        cfg.seq_size <= 0 || cfg.seq_size > MFS_MAX_IO ||
+        cfg.file_size > 30 * MFS_BLOCK_SIZE || cfg.depth < 1) {
+        usage();
+    }
+
+    int pipes[cfg.procs];
+    pid_t pids[cfg.procs];
+    unsigned long long start = now_ns();
+    for (int p = 0; p < cfg.procs; p++) {
+        int fds[2];
+        if (pipe(fds) < 0) {
+            perror("pipe");
+            exit(1);
+        }
+        pids[p] = fork();
+        if (pids[p] < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pids[p] == 0) {
+            close(fds[0]);
+            run_process(p, fds[1]);
+            exit(0);
+        }
+        close(fds[1]);
+        pipes[p] = fds[0];
+    }
+
+    unsigned long long *all = NULL;
+    long total = 0;
+    long errors = 0;
+    long retransmits = 0;
+    int failed = 0;
+    for (int p = 0; p < cfg.procs; p++) {
+        for (int t = 0; t < cfg.threads; t++) {
+            long header[3];
+            if (read_all(pipes[p], header, sizeof(header)) < 0) {
+                failed++;
+                break;
+            }
+            if (header[0] < 0) {
+                failed++;
+            } else {
+                errors += header[0];
+            }
+            retransmits += header[1];
+            all = realloc(all, (total + header[2] + 1) * sizeof(unsigned long long));
+            assert(all != NULL);
+            if (read_all(pipes[p], all + total, header[2] * sizeof(unsigned long long)) < 0) {
+                failed++;
+                break;
+            }
+            total += header[2];
+        }
+        close(pipes[p]);
+        waitpid(pids[p], NULL, 0);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    if (elapsed > cfg.duration) {
+        // setup and cleanup aren't part of the measurement
+        elapsed = cfg.duration;
+    }
+
+    qsort(all, total, sizeof(unsigned long long), compare);
+    double sum = 0;
+    for (long i = 0; i < total; i++) {
+        sum += all[i];
+    }
+    double mean = total > 0 ? sum / total / 1e3 : 0;
+    double max = total > 0 ? all[total - 1] / 1e3 : 0;
+
+    if (cfg.json) {
+        printf("{\"workload\": \"%s\", \"procs\": %d, \"threads\": %d, \"duration_s\": %.3f, "
+            "\"target_rate\": %.1f, \"io_size\": %d, \"file_size\": %d, \"depth\": %d, "
+            "\"ops\": %ld, \"errors\": %ld, \"retransmits\": %ld, \"failed_workers\": %d, \"throughput_ops\": %.1f, "
+            "\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+            cfg.workload, cfg.procs, cfg.threads, elapsed, cfg.rate, cfg.io_size, cfg.file_size, cfg.depth,
+            total, errors, retransmits, failed, total / elapsed,
+            mean, percentile(all, total, 0.5), percentile(all, total, 0.99), percentile(all, total, 0.999), max);
+    } else {
+        printf("workload    %s (%d procs x %d threads, %s)\n", cfg.workload, cfg.procs, cfg.threads,
+            cfg.rate > 0 ? "open loop" : "closed loop");
+        printf("ops         %ld (%ld errors, %ld retransmits, %d failed workers)\n", total, errors, retransmits, failed);
+        printf("throughput  %.1f ops/s\n", total / elapsed);
+        printf("latency     mean %.1fus  p50 %.1fus  p99 %.1fus  p999 %.1fus  max %.1fus\n",
+            mean, percentile(all, total, 0.5), percentile(all, total, 0.99), percentile(all, total, 0.999), max);
+    }
+    free(all);
+    return failed == 0 ? 0 : 1;
+}
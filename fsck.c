@@ -0,0 +1,476 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ufs.h"
+#include "fsck.h"
+
+// consistency checker shared by mfsck and the server's startup check.
+//
+// the expensive passes (walking every inode, comparing every bitmap word)
+// are split into disjoint slices, one per thread. claims on data blocks
+// and directory references are counted with atomics so threads never
+// have to coordinate; the few repairs that need a global view (orphans,
+// double allocations) run single threaded in between.
+
+#define MAX_THREADS 64
+#define REPORT_LIMIT 20 // per kind of problem, when verbose
+
+// dir_slots of them, as many as fit in a block
+typedef struct {
+    dir_ent_t entries[0];
+} dir_block_t;
+
+typedef struct {
+    int inum;
+    int slot;
+} claim_t;
+
+static char *img;
+static super_t *sb;
+static unsigned int *ibits;
+static unsigned int *dbits;
+static inode_t *inodes;
+static int block_size;
+static int dir_slots;
+static int fix;
+static int loud;
+static fsck_result_t *res;
+
+static int *block_refs; // claims per data block
+static int *links;      // directory entries naming each inode
+
+static pthread_mutex_t dups_lock = PTHREAD_MUTEX_INITIALIZER;
+static claim_t *dups;
+static int ndups;
+static int dups_cap;
+
+static unsigned int get_bit(unsigned int *bitmap, int position) {
+    int index = position / 32;
+    int offset = 31 - (position % 32);
+    return (bitmap[index] >> offset) & 0x1;
+}
+
+static void set_bit(unsigned int *bitmap, int position, int value) {
+    int index = position / 32;
+    int offset = 31 - (position % 32);
+    if (value == 1) {
+        bitmap[index] |= 0x1 << offset;
+    } else if (value == 0) {
+        bitmap[index] &= ~(0x1 << offset);
+    }
+}
+
+static char *block_ptr(int addr) {
+    return img + (long)addr * block_size;
+}
+
+static void problem(long *counter, const char *fmt, ...) {
+    long seen = __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+    if (!loud || seen >= REPORT_LIMIT) {
+        return;
+    }
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "fsck: %s%s\n", line, fix ? " (repaired)" : "");
+}
+
+// data block index of direct pointer addr, -1 if outside the data region
+static int data_index(int addr) {
+    int index = addr - sb->data_region_addr;
+    if (index < 0 || index >= sb->num_data) {
+        return -1;
+    }
+    return index;
+}
+
+static int is_dot(char *name) {
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+static int valid_inode(int inum) {
+    return inum >= 0 && inum < sb->num_inodes && get_bit(ibits, inum) == 1;
+}
+
+// pass 1: claim the blocks of every allocated inode in [lo, hi) and count
+// the references its directory entries make to other inodes
+static void check_inodes(int lo, int hi) {
+    for (int inum = lo; inum < hi; inum++) {
+        if (get_bit(ibits, inum) != 1) {
+            continue;
+        }
+        inode_t *inode = &inodes[inum];
+        if (inode->type == (UFS_REGULAR_FILE | UFS_INLINE)) {
+            // contents live in direct[], no blocks to claim
+            if (inode->size < 0 || inode->size > UFS_INLINE_MAX) {
+                problem(&res->bad_inodes, "inode %d: inline file of size %d", inum, inode->size);
+            }
+            continue;
+        }
+        if ((inode->type != UFS_DIRECTORY && inode->type != UFS_REGULAR_FILE) ||
+            inode->size < 0 || inode->size > DIRECT_PTRS * block_size) {
+            // no way to guess what it was meant to be; leave it alone but
+            // keep its blocks claimed so they aren't handed out again
+            problem(&res->bad_inodes, "inode %d: bad type %d / size %d", inum, inode->type, inode->size);
+        }
+
+        for (int b = 0; b < DIRECT_PTRS; b++) {
+            int addr = (int)inode->direct[b];
+            if (addr == -1) {
+                continue;
+            }
+            int index = data_index(addr);
+            if (index == -1) {
+                problem(&res->bad_pointers, "inode %d: direct[%d] = %d is outside the data region", inum, b, addr);
+                if (fix) {
+                    inode->direct[b] = -1;
+                }
+                continue;
+            }
+            if (__atomic_fetch_add(&block_refs[index], 1, __ATOMIC_RELAXED) > 0) {
+                problem(&res->double_blocks, "inode %d: block %d is also used by another inode", inum, addr);
+                pthread_mutex_lock(&dups_lock);
+                if (ndups == dups_cap) {
+                    dups_cap = dups_cap == 0 ? 64 : 2 * dups_cap;
+                    dups = realloc(dups, dups_cap * sizeof(claim_t));
+                }
+                dups[ndups].inum = inum;
+                dups[ndups].slot = b;
+                ndups++;
+                pthread_mutex_unlock(&dups_lock);
+            }
+        }
+
+        if (inode->type != UFS_DIRECTORY) {
+            continue;
+        }
+        int used = 0;
+        for (int b = 0; b < DIRECT_PTRS; b++) {
+            int addr = (int)inode->direct[b];
+            if (addr == -1 || data_index(addr) == -1) {
+                continue;
+            }
+            dir_block_t *dir = (dir_block_t*)block_ptr(addr);
+            for (int i = 0; i < dir_slots; i++) {
+                dir_ent_t *e = &dir->entries[i];
+                if (e->inum == -1) {
+                    continue;
+                }
+                if (!valid_inode(e->inum)) {
+                    problem(&res->dangling_entries, "directory %d: entry %.28s names free inode %d", inum, e->name, e->inum);
+                    if (fix) {
+                        e->inum = -1;
+                        continue;
+                    }
+                }
+                used++;
+                if (valid_inode(e->inum) && !is_dot(e->name)) {
+                    __atomic_fetch_add(&links[e->inum], 1, __ATOMIC_RELAXED);
+                }
+            }
+        }
+        int expected = used * sizeof(dir_ent_t);
+        if (inode->size != expected) {
+            problem(&res->bad_dir_sizes, "directory %d: size %d but %d entries in use", inum, inode->size, used);
+            if (fix) {
+                inode->size = expected;
+            }
+        }
+    }
+}
+
+// free inum and drop the claims on its blocks
+static void release(int inum) {
+    inode_t *inode = &inodes[inum];
+    for (int b = 0; b < DIRECT_PTRS && !(inode->type & UFS_INLINE); b++) {
+        int index = data_index((int)inode->direct[b]);
+        if ((int)inode->direct[b] != -1 && index != -1) {
+            block_refs[index]--;
+        }
+    }
+    set_bit(ibits, inum, 0);
+}
+
+// pass 2: release inodes no directory refers to. releasing a directory
+// drops the references its entries made, which may orphan more inodes.
+static void check_orphans() {
+    int *stack = malloc(sb->num_inodes * sizeof(int));
+    int top = 0;
+    for (int inum = 1; inum < sb->num_inodes; inum++) {
+        if (get_bit(ibits, inum) == 1 && links[inum] == 0) {
+            stack[top++] = inum;
+        }
+    }
+    while (top > 0) {
+        int inum = stack[--top];
+        inode_t *inode = &inodes[inum];
+        problem(&res->orphan_inodes, "inode %d: not in any directory", inum);
+
+        if (inode->type == UFS_DIRECTORY) {
+            for (int b = 0; b < DIRECT_PTRS; b++) {
+                int addr = (int)inode->direct[b];
+                if (addr == -1 || data_index(addr) == -1) {
+                    continue;
+                }
+                dir_block_t *dir = (dir_block_t*)block_ptr(addr);
+                for (int i = 0; i < dir_slots; i++) {
+                    dir_ent_t *e = &dir->entries[i];
+                    if (e->inum <= 0 || !valid_inode(e->inum) || is_dot(e->name)) {
+                        continue;
+                    }
+                    if (links[e->inum] > 0 && --links[e->inum] == 0) {
+                        stack[top++] = e->inum;
+                    }
+                }
+            }
+        }
+        if (fix) {
+            release(inum);
+        }
+    }
+    free(stack);
+}
+
+// pass 3: link counts can't see a cycle of directories that has come
+// loose from the tree, each naming the next. walk down from the root
+// and report what's left over (orphans are already reported)
+static void check_reachable() {
+    char *seen = calloc(sb->num_inodes, 1);
+    int *queue = malloc(sb->num_inodes * sizeof(int));
+    int head = 0, tail = 0;
+    seen[0] = 1;
+    queue[tail++] = 0;
+    while (head < tail) {
+        inode_t *inode = &inodes[queue[head++]];
+        if (inode->type != UFS_DIRECTORY) {
+            continue;
+        }
+        for (int b = 0; b < DIRECT_PTRS; b++) {
+            int addr = (int)inode->direct[b];
+            if (addr == -1 || data_index(addr) == -1) {
+                continue;
+            }
+            dir_block_t *dir = (dir_block_t*)block_ptr(addr);
+            for (int i = 0; i < dir_slots; i++) {
+                dir_ent_t *e = &dir->entries[i];
+                if (!valid_inode(e->inum) || is_dot(e->name) || seen[e->inum]) {
+                    continue;
+                }
+                seen[e->inum] = 1;
+                queue[tail++] = e->inum;
+            }
+        }
+    }
+    for (int inum = 1; inum < sb->num_inodes; inum++) {
+        if (get_bit(ibits, inum) != 1 || seen[inum] || links[inum] == 0) {
+            continue;
+        }
+        problem(&res->unreachable_inodes, "inode %d: not reachable from the root", inum);
+        if (fix) {
+            release(inum);
+        }
+    }
+    free(seen);
+    free(queue);
+}
+
+// pass 4: blocks on the pending list belong to no inode but aren't free
+// yet either; claim them. a run that overlaps blocks in use (or another
+// run) is dropped, leaving its blocks to the bitmap pass
+static void check_pending() {
+    ufs_pending_t *p = UFS_PENDING(img);
+    if (p->num_runs < 0 || p->num_runs > UFS_PENDING_RUNS) {
+        problem(&res->bad_pending, "pending list of %d runs", p->num_runs);
+        if (fix) {
+            p->num_runs = 0;
+        }
+        return;
+    }
+    for (int i = 0; i < p->num_runs; i++) {
+        ufs_run_t *run = &p->runs[i];
+        int index = data_index(run->start);
+        int ok = index != -1 && run->len > 0 && index + run->len <= sb->num_data;
+        for (int b = 0; ok && b < run->len; b++) {
+            ok = block_refs[index + b] == 0;
+        }
+        if (!ok) {
+            problem(&res->bad_pending, "pending run %d: blocks %d..%d are not free to reclaim", i,
+                run->start, run->start + run->len - 1);
+            if (fix) {
+                *run = p->runs[--p->num_runs];
+                i--;
+            }
+            continue;
+        }
+        for (int b = 0; b < run->len; b++) {
+            block_refs[index + b]++;
+        }
+    }
+}
+
+// pass 5: give every extra claimant of a shared block its own copy
+static void fix_double_blocks() {
+    int cursor = 0;
+    for (int d = 0; d < ndups; d++) {
+        if (get_bit(ibits, dups[d].inum) != 1) {
+            continue; // released as an orphan
+        }
+        inode_t *inode = &inodes[dups[d].inum];
+        int addr = (int)inode->direct[dups[d].slot];
+        int index = data_index(addr);
+        if (index == -1 || block_refs[index] <= 1) {
+            continue;
+        }
+        while (cursor < sb->num_data && (block_refs[cursor] != 0 || get_bit(dbits, cursor) == 1)) {
+            cursor++;
+        }
+        block_refs[index]--;
+        if (cursor == sb->num_data) {
+            // out of space: drop the pointer rather than keep sharing
+            inode->direct[dups[d].slot] = -1;
+            continue;
+        }
+        int new_addr = cursor + sb->data_region_addr;
+        memcpy(block_ptr(new_addr), block_ptr(addr), block_size);
+        inode->direct[dups[d].slot] = new_addr;
+        block_refs[cursor] = 1;
+        set_bit(dbits, cursor, 1);
+    }
+}
+
+// pass 6: the data bitmap must match the claims exactly. slices are
+// whole bitmap words so repairs never race.
+static void check_data_bitmap(int lo, int hi) {
+    for (int index = lo; index < hi; index++) {
+        int marked = get_bit(dbits, index);
+        if (marked && block_refs[index] == 0) {
+            problem(&res->leaked_blocks, "block %d: allocated but unused", index + sb->data_region_addr);
+            if (fix) {
+                set_bit(dbits, index, 0);
+            }
+        } else if (!marked && block_refs[index] > 0) {
+            problem(&res->missing_blocks, "block %d: in use but free in the bitmap", index + sb->data_region_addr);
+            if (fix) {
+                set_bit(dbits, index, 1);
+            }
+        }
+    }
+}
+
+typedef struct {
+    void (*fn)(int, int);
+    int lo;
+    int hi;
+} slice_t;
+
+static void *run_slice(void *arg) {
+    slice_t *slice = (slice_t*)arg;
+    slice->fn(slice->lo, slice->hi);
+    return NULL;
+}
+
+// run fn over [0, n) split across nthreads; slices are multiples of 32
+static void run_parallel(void (*fn)(int, int), int n, int nthreads) {
+    pthread_t threads[MAX_THREADS];
+    slice_t slices[MAX_THREADS];
+    int started[MAX_THREADS];
+    int per = (n + nthreads - 1) / nthreads;
+    per = (per + 31) / 32 * 32;
+
+    int count = 0;
+    for (int lo = 0; lo < n; lo += per) {
+        slices[count].fn = fn;
+        slices[count].lo = lo;
+        slices[count].hi = lo + per < n ? lo + per : n;
+        // if no thread can be had, do the slice here
+        started[count] = pthread_create(&threads[count], NULL, run_slice, &slices[count]) == 0;
+        if (!started[count]) {
+            run_slice(&slices[count]);
+        }
+        count++;
+    }
+    for (int t = 0; t < count; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+}
+
+long fsck_image(void *image, long image_size, int nthreads, int repair, int verbose, fsck_result_t *result) {
+    img = (char*)image;
+    sb = (super_t*)image;
+    fix = repair;
+    loud = verbose;
+    res = result;
+    memset(res, 0, sizeof(fsck_result_t));
+
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > MAX_THREADS) {
+        nthreads = MAX_THREADS;
+    }
+
+    // the layout itself has to be sane before anything else is looked at
+    if (image_size < UFS_BLOCK_SIZE || !UFS_VALID_BLOCK_SIZE(UFS_BLOCK_SIZE_OF(sb))) {
+        fprintf(stderr, "fsck: super block does not describe this image\n");
+        return -1;
+    }
+    block_size = UFS_BLOCK_SIZE_OF(sb);
+    dir_slots = block_size / sizeof(dir_ent_t);
+    long bits_per_block = 8 * block_size;
+    long total_blocks = 1L + sb->inode_bitmap_len + sb->data_bitmap_len + sb->inode_region_len + sb->data_region_len;
+    if (total_blocks * block_size > image_size ||
+        sb->num_inodes <= 0 || sb->num_data <= 0 ||
+        sb->num_inodes > sb->inode_bitmap_len * bits_per_block ||
+        sb->num_data > sb->data_bitmap_len * bits_per_block ||
+        (long)sb->num_inodes * sizeof(inode_t) > (long)sb->inode_region_len * block_size ||
+        sb->num_data > sb->data_region_len) {
+        fprintf(stderr, "fsck: super block does not describe this image\n");
+        return -1;
+    }
+
+    ibits = (unsigned int*)block_ptr(sb->inode_bitmap_addr);
+    dbits = (unsigned int*)block_ptr(sb->data_bitmap_addr);
+    inodes = (inode_t*)block_ptr(sb->inode_region_addr);
+
+    if (get_bit(ibits, 0) != 1 || inodes[0].type != UFS_DIRECTORY) {
+        fprintf(stderr, "fsck: root directory is missing\n");
+        res->bad_inodes++;
+        return res->bad_inodes;
+    }
+
+    block_refs = calloc(sb->num_data, sizeof(int));
+    links = calloc(sb->num_inodes, sizeof(int));
+    if (block_refs == NULL || links == NULL) {
+        perror("calloc");
+        free(block_refs);
+        free(links);
+        return -1;
+    }
+    ndups = 0;
+
+    run_parallel(check_inodes, sb->num_inodes, nthreads);
+    check_orphans();
+    check_reachable();
+    check_pending();
+    if (fix) {
+        fix_double_blocks();
+    }
+    run_parallel(check_data_bitmap, sb->num_data, nthreads);
+
+    free(block_refs);
+    free(links);
+    free(dups);
+    dups = NULL;
+    dups_cap = 0;
+
+    return res->bad_inodes + res->bad_pointers + res->double_blocks + res->missing_blocks +
+        res->leaked_blocks + res->dangling_entries + res->bad_dir_sizes + res->orphan_inodes + res->unreachable_inodes +
+        res->bad_pending;
+}
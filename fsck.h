@@ -0,0 +1,25 @@
+#ifndef __fsck_h__
+#define __fsck_h__
+
+// problems found (and, when repairing, fixed) by fsck_image()
+typedef struct {
+    long bad_inodes;        // allocated inode with an unknown type or size
+    long bad_pointers;      // direct[] entry outside the data region
+    long double_blocks;     // data block claimed by more than one inode
+    long missing_blocks;    // block in use but clear in the data bitmap
+    long leaked_blocks;     // block set in the data bitmap but unused
+    long dangling_entries;  // directory entry naming a free/invalid inode
+    long bad_dir_sizes;     // directory size disagrees with its entries
+    long orphan_inodes;     // allocated inode no directory refers to
+    long unreachable_inodes; // in a directory, but none the root leads to
+    long bad_pending;       // pending run that isn't unused data blocks
+} fsck_result_t;
+
+// check the image mapped at image against its own super block using
+// nthreads worker threads. when repair is set, problems are fixed in
+// place (the caller is responsible for flushing the mapping).
+// returns the total number of problems found, -1 if the super block
+// itself doesn't fit the image.
+long fsck_image(void *image, long image_size, int nthreads, int repair, int verbose, fsck_result_t *result);
+
+#endif // __fsck_h__
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+
+static const char *op_names[MFS_STATS_OPS] = {
+    "other", "lookup", "stat", "write", "read", "creat", "unlink", "shutdown",
+    "error", "stats", "replicate", "truncate", "rename", "append", "copy", "copy_range", "stat_many", "creat_many",
+    "reclaim", "grow",
+};
+
+static const char *phase_names[MFS_STATS_PHASES] = {
+    "queue", "decode", "handler", "flush", "send",
+};
+
+const char *metrics_op_name(int op) {
+    if (op < 0 || op >= MFS_STATS_OPS || op_names[op] == NULL) {
+        return "unknown";
+    }
+    return op_names[op];
+}
+
+const char *metrics_phase_name(int phase) {
+    if (phase < 0 || phase >= MFS_STATS_PHASES) {
+        return "unknown";
+    }
+    return phase_names[phase];
+}
+
+static int hist_bucket(unsigned long long v) {
+    if (v < (1 << HIST_SUB_BITS)) {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int exp = msb - HIST_SUB_BITS + 1;
+    if (exp > HIST_MAX_BITS - HIST_SUB_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    int sub = (v >> (exp - 1)) & ((1 << HIST_SUB_BITS) - 1);
+    return (exp << HIST_SUB_BITS) + sub;
+}
+
+// largest value that lands in bucket b
+static unsigned long long hist_bucket_top(int b) {
+    if (b < (1 << HIST_SUB_BITS)) {
+        return b;
+    }
+    int exp = b >> HIST_SUB_BITS;
+    unsigned long long sub = b & ((1 << HIST_SUB_BITS) - 1);
+    unsigned long long low = ((1ULL << HIST_SUB_BITS) + sub) << (exp - 1);
+    return low + (1ULL << (exp - 1)) - 1;
+}
+
+void hist_record(hist_t *h, unsigned long long ns) {
+    h->count++;
+    h->total += ns;
+    if (ns > h->max) {
+        h->max = ns;
+    }
+    h->buckets[hist_bucket(ns)]++;
+}
+
+unsigned long long hist_percentile(hist_t *h, double q) {
+    if (h->count == 0) {
+        return 0;
+    }
+    unsigned long long want = (unsigned long long)(q * h->count);
+    if (want < 1) {
+        want = 1;
+    }
+    unsigned long long seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= want) {
+            unsigned long long top = hist_bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+int metrics_op(int mtype) {
+    if (mtype < 0 || mtype >= MFS_STATS_OPS) {
+        return 0;
+    }
+    return mtype;
+}
+
+static void hist_merge(hist_t *dst, hist_t *src) {
+    dst->count += src->count;
+    dst->total += src->total;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        dst->buckets[b] += src->buckets[b];
+    }
+}
+
+void metrics_merge(metrics_t *dst, metrics_t *src) {
+    for (int i = 0; i < MFS_STATS_OPS; i++) {
+        dst->errors[i] += src->errors[i];
+        hist_merge(&dst->ops[i], &src->ops[i]);
+    }
+    for (int i = 0; i < MFS_STATS_PHASES; i++) {
+        hist_merge(&dst->phases[i], &src->phases[i]);
+    }
+}
+
+static void summarize(hist_t *h, MFS_Latency_t *out) {
+    out->count = h->count;
+    out->total_ns = h->total;
+    out->p50_ns = hist_percentile(h, 0.5);
+    out->p99_ns = hist_percentile(h, 0.99);
+    out->p999_ns = hist_percentile(h, 0.999);
+    out->max_ns = h->max;
+}
+
+// fills in the latency part of out; gauges are left to the caller
+void metrics_summarize(metrics_t *m, MFS_Stats_t *out) {
+    for (int i = 0; i < MFS_STATS_OPS; i++) {
+        out->errors[i] = m->errors[i];
+        summarize(&m->ops[i], &out->ops[i]);
+    }
+    for (int i = 0; i < MFS_STATS_PHASES; i++) {
+        summarize(&m->phases[i], &out->phases[i]);
+    }
+}
+
+static void dump_latency(FILE *f, MFS_Latency_t *l) {
+    fprintf(f, "{\"count\": %llu, \"total_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu",
+        l->count, l->total_ns, l->p50_ns, l->p99_ns, l->p999_ns, l->max_ns);
+}
+
+int metrics_dump(MFS_Stats_t *stats, char *path) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        return -1;
+    }
+
+    fprintf(f, "{\n  \"uptime_ms\": %llu,\n", stats->uptime_ms);
+    fprintf(f, "  \"inodes\": {\"total\": %d, \"free\": %d},\n", stats->num_inodes, stats->free_inodes);
+    fprintf(f, "  \"data_blocks\": {\"total\": %d, \"free\": %d},\n", stats->num_data, stats->free_data);
+    fprintf(f, "  \"ops\": {\n");
+    int first = 1;
+    for (int i = 0; i < MFS_STATS_OPS; i++) {
+        if (stats->ops[i].count == 0) {
+            continue;
+        }
+        fprintf(f, "%s    \"%s\": ", first ? "" : ",\n", metrics_op_name(i));
+        dump_latency(f, &stats->ops[i]);
+        fprintf(f, ", \"errors\": %llu}", stats->errors[i]);
+        first = 0;
+    }
+    fprintf(f, "\n  },\n  \"phases\": {\n");
+    for (int i = 0; i < MFS_STATS_PHASES; i++) {
+        fprintf(f, "    \"%s\": ", metrics_phase_name(i));
+        dump_latency(f, &stats->phases[i]);
+        fprintf(f, "}%s\n", i + 1 < MFS_STATS_PHASES ? "," : "");
+    }
+    fprintf(f, "  }\n}\n");
+
+    if (fclose(f) != 0) {
+        return -1;
+    }
+    return rename(tmp, path);
+}
@@ -0,0 +1,39 @@
+#ifndef __metrics_h__
+#define __metrics_h__
+
+#include "mfs.h"
+
+// log-linear latency histogram: 8 sub-buckets per power of two gives
+// ~12% resolution from 1ns up to ~18 minutes
+#define HIST_SUB_BITS 3
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long total;
+    unsigned long long max;
+    unsigned long long buckets[HIST_BUCKETS];
+} hist_t;
+
+typedef struct {
+    unsigned long long errors[MFS_STATS_OPS];
+    hist_t ops[MFS_STATS_OPS];
+    hist_t phases[MFS_STATS_PHASES];
+} metrics_t;
+
+void hist_record(hist_t *h, unsigned long long ns);
+unsigned long long hist_percentile(hist_t *h, double q);
+
+// op index for an mtype; unknown types share slot 0
+int metrics_op(int mtype);
+// names of op and phase slots, as in the stats dump
+const char *metrics_op_name(int op);
+const char *metrics_phase_name(int phase);
+void metrics_merge(metrics_t *dst, metrics_t *src);
+void metrics_summarize(metrics_t *m, MFS_Stats_t *out);
+
+// write stats as JSON to path (atomically, via a rename)
+int metrics_dump(MFS_Stats_t *stats, char *path);
+
+#endif // __metrics_h__
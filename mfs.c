@@ -2,11 +2,46 @@
 #include <stdlib.h>
 #include <time.h>
 #include <sys/select.h>
+#include <sys/time.h>
+#include <stddef.h>
 #include "mfs.h"
 #include "udp.h"
-
-int sd;
-struct sockaddr_in addrSnd, addrRcv;
+#include "shm.h"
+
+// one connection per thread, so a multithreaded client can have each
+// thread MFS_Init its own socket
+__thread int sd;
+__thread struct sockaddr_in addrSnd, addrRcv;
+__thread int seq;
+__thread int rto_ms;
+__thread long retransmits;
+
+// set when MFS_Init was given "shm:<socket path>"
+__thread shm_chan_t *chan;
+// set for "tcp:<host>" and "unix:<socket path>": payloads of up to
+// MFS_MAX_IO bytes travel in this buffer
+__thread char *stream_buf;
+
+// set for "shards:<host>:<port>,...". every shard is a server with an
+// image of its own; the client splits the namespace between them by
+// top level name and keeps the shard in the high bits of each inum
+#define MAX_SHARDS 64
+#define SHARD_MASK ((1 << MFS_SHARD_SHIFT) - 1)
+__thread int nshards;
+__thread struct sockaddr_in shards[MAX_SHARDS];
+__thread int shard; // the one the call in progress goes to
+
+// MFS_REPLICAS="host:port,..." (environment) names backups of a
+// replicated server; lookups, stats and reads go round robin over the
+// server and them (see mfs.h for what that means for consistency)
+#define MAX_REPLICAS 16
+__thread struct sockaddr_in replicas[MAX_REPLICAS + 1]; // [0] is the server
+__thread int nreplicas;
+__thread int next_replica;
+
+#define DEFAULT_RTO_MS 500
+#define MAX_RTO_MS 5000
+#define MAX_WAIT_MS 30000
 
 int udp_send(message_t *request) {
     int rc = UDP_Write(sd, &addrSnd, (char *) request, sizeof(message_t));
@@ -17,63 +52,305 @@ int udp_send(message_t *request) {
     return 0;
 }
 
-int udp_receive(message_t *response) {
-    // wait for reply
-    struct timeval timeout;
-    // set the timeout to 30s
-    timeout.tv_sec = 30;    
-    timeout.tv_usec = 0;
+// wait up to timeout_ms for the reply to request seq, dropping replies
+// to earlier (retransmitted) requests. 1 on timeout.
+int udp_receive(message_t *response, int seq, int timeout_ms) {
+    struct timeval now, deadline;
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_usec += (timeout_ms % 1000) * 1000;
+    if (deadline.tv_usec >= 1000000) {
+        deadline.tv_sec++;
+        deadline.tv_usec -= 1000000;
+    }
 
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(sd, &readfds);
+    while (1) {
+        gettimeofday(&now, NULL);
+        struct timeval timeout;
+        timersub(&deadline, &now, &timeout);
+        if (timeout.tv_sec < 0) {
+            return 1;
+        }
+
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(sd, &readfds);
+
+        int rc = select(sd+1, &readfds, NULL, NULL, &timeout);
+        if (rc < 0) {
+            // select err
+            return -1;
+        }
+        if (rc == 0) {
+            return 1;
+        }
 
-    if (select(sd+1, &readfds, NULL, NULL, &timeout) < 0) {
-        // select err
-        return -1;
+        rc = UDP_Read(sd, &addrRcv, (char *) response, sizeof(message_t));
+        if (rc <= 0) {
+            return -1;
+        }
+        if (response->seq == seq) {
+            return 0;
+        }
+        // a late or duplicated reply to something already answered
     }
+}
 
-    int rc;
-    if (FD_ISSET(sd, &readfds)) {
-        rc = UDP_Read(sd, &addrRcv, (char *) response, sizeof(message_t));
-    } else {
-        printf("client:: request timeout\n");
+// payloads don't go through request/response on the shm transport:
+// callers write and read them in the channel directly, which saves a
+// copy of up to 4KB each way. streams keep them in stream_buf, which
+// unlike message_t.buffer is big enough for MFS_MAX_IO
+char *request_data(message_t *request) {
+    if (stream_buf != NULL) {
+        return stream_buf;
+    }
+    return chan != NULL ? chan->request.buffer : request->buffer;
+}
+
+char *reply_data(message_t *response) {
+    if (stream_buf != NULL) {
+        return stream_buf;
+    }
+    return chan != NULL ? chan->response.buffer : response->buffer;
+}
+
+// largest read or write one call can do on this thread's transport
+int max_io() {
+    return stream_buf != NULL ? MFS_MAX_IO : MFS_BUFFER;
+}
+
+// the stream delivers in order and doesn't lose anything: no seq
+// matching or retransmits needed
+int stream_call(message_t *request, message_t *response) {
+    request->seq = ++seq;
+    int body = MFS_HAS_BODY(request->mtype) ? request->nbytes : 0;
+    if (STREAM_Send(sd, (char *) request, offsetof(message_t, buffer), stream_buf, body) < 0) {
+        return -1;
+    }
+    if (STREAM_Recv(sd, (char *) response, offsetof(message_t, buffer), stream_buf, MFS_MAX_IO) < 0) {
         return -1;
     }
+    return 0;
+}
 
-    if (rc > 0) {
-        return 0;
+#define SHM_POLL_MS 100
+
+int shm_call(message_t *request, message_t *response) {
+    request->seq = ++seq;
+    int waited_ms = 0;
+    while (1) {
+        memcpy(&chan->request, request, offsetof(message_t, buffer));
+        SHM_Post(chan, SHM_REQUEST);
+        while (SHM_Wait(chan, SHM_REPLY, SHM_POLL_MS) != 0) {
+            waited_ms += SHM_POLL_MS;
+            if (SHM_Gone(sd) || waited_ms >= MAX_WAIT_MS) {
+                printf("client:: request timeout\n");
+                return -1;
+            }
+        }
+        if (chan->response.seq == request->seq) {
+            break;
+        }
+        // the late reply to a call that timed out. the server was still
+        // on that one when this was posted, so post it again
+    }
+    memcpy(response, &chan->response, offsetof(message_t, buffer));
+    return 0;
+}
+
+// send request to addrSnd and wait for its reply, retransmitting on
+// timeout
+int udp_exchange(message_t *request, message_t *response) {
+    request->seq = ++seq;
+    int timeout_ms = rto_ms;
+    int waited_ms = 0;
+
+    while (1) {
+        if (udp_send(request) < 0) {
+            return -1;
+        }
+        int rc = udp_receive(response, request->seq, timeout_ms);
+        if (rc <= 0) {
+            return rc;
+        }
+        waited_ms += timeout_ms;
+        if (waited_ms >= MAX_WAIT_MS) {
+            printf("client:: request timeout\n");
+            return -1;
+        }
+        retransmits++;
+        timeout_ms *= 2;
+        if (timeout_ms > MAX_RTO_MS) {
+            timeout_ms = MAX_RTO_MS;
+        }
+        if (timeout_ms > MAX_WAIT_MS - waited_ms) {
+            timeout_ms = MAX_WAIT_MS - waited_ms;
+        }
+    }
+}
+
+int udp_call(message_t *request, message_t *response) {
+    if (chan != NULL) {
+        return shm_call(request, response);
+    }
+    if (stream_buf != NULL) {
+        return stream_call(request, response);
+    }
+    if (nreplicas == 0) {
+        return udp_exchange(request, response);
+    }
+    int read_only = request->mtype == MFS_LOOKUP || request->mtype == MFS_STAT || request->mtype == MFS_READ ||
+        request->mtype == MFS_STAT_MANY;
+    addrSnd = replicas[read_only ? next_replica++ % nreplicas : 0];
+    int rc = udp_exchange(request, response);
+    if (rc == 0 && response->rc == MFS_STALE) {
+        // a backup that lost its primary; the server is always current
+        addrSnd = replicas[0];
+        rc = udp_exchange(request, response);
+    }
+    return rc;
+}
+
+int shard_of_name(char *name) {
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    for (char *p = name; *p != '\0'; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return h % nshards;
+}
+
+// point the next call at the shard that owns inum, and return the inum
+// that shard knows it by (-1 if there's no such shard). the root is on
+// every shard; names in it are spread over them by hash
+int route(int inum, char *name) {
+    if (nshards == 0) {
+        return inum;
+    }
+    if (inum == 0 && name != NULL) {
+        shard = shard_of_name(name);
     } else {
+        shard = inum >> MFS_SHARD_SHIFT;
+        inum &= SHARD_MASK;
+    }
+    if (shard < 0 || shard >= nshards) {
         return -1;
     }
+    addrSnd = shards[shard];
+    return inum;
 }
 
-int MFS_Init(char *hostname, int port){
-    int MIN_PORT = 20000;
-    int MAX_PORT = 40000;
+// the global inum for one the current shard returned
+int unroute(int inum) {
+    if (nshards == 0 || inum <= 0) {
+        return inum; // every shard's root is the one root
+    }
+    return (shard << MFS_SHARD_SHIFT) | inum;
+}
 
-    srand(time(0));
-    int mfs_port = (rand() % (MAX_PORT - MIN_PORT) + MIN_PORT);
+// "host:port,host:port,...", returns how many or -1
+int parse_hosts(char *list, struct sockaddr_in *addrs, int max) {
+    char *copy = strdup(list);
+    char *save;
+    int n = 0;
+    for (char *entry = strtok_r(copy, ",", &save); entry != NULL; entry = strtok_r(NULL, ",", &save)) {
+        char *colon = strrchr(entry, ':');
+        if (colon == NULL || n == max) {
+            free(copy);
+            return -1;
+        }
+        *colon = '\0';
+        if (UDP_FillSockAddr(&addrs[n], entry, atoi(colon + 1)) < 0) {
+            free(copy);
+            return -1;
+        }
+        n++;
+    }
+    free(copy);
+    return n;
+}
 
-    // Bind random client port number
-    sd = UDP_Open(mfs_port);
+long MFS_Retransmits() {
+    return retransmits;
+}
+
+int MFS_Init(char *hostname, int port){
+    if (strncmp(hostname, "shm:", 4) == 0) {
+        // same host: port is unused
+        sd = SHM_Connect(hostname + 4, &chan);
+        if (sd < 0) {
+            chan = NULL;
+            return -1;
+        }
+        return 0;
+    }
+    if (strncmp(hostname, "tcp:", 4) == 0 || strncmp(hostname, "unix:", 5) == 0) {
+        if (hostname[0] == 't') {
+            sd = STREAM_ConnectTCP(hostname + 4, port);
+        } else {
+            sd = STREAM_ConnectUnix(hostname + 5);
+        }
+        if (sd < 0) {
+            return -1;
+        }
+        stream_buf = malloc(MFS_MAX_IO);
+        if (stream_buf == NULL) {
+            close(sd);
+            return -1;
+        }
+        return 0;
+    }
+
+    // Bind any free client port; picking one at random collides when
+    // several clients start in the same second
+    sd = UDP_Open(0);
     if (sd < 0) {
         // udp_open failed
      return -1;
     }
 
-    int rc = UDP_FillSockAddr(&addrSnd, hostname, port);
+    int rc;
+    if (strncmp(hostname, "shards:", 7) == 0) {
+        nshards = parse_hosts(hostname + 7, shards, MAX_SHARDS);
+        rc = nshards > 0 ? 0 : -1;
+        addrSnd = shards[0];
+    } else {
+        rc = UDP_FillSockAddr(&addrSnd, hostname, port);
+    }
     if (rc < 0) {
         // init failed
      return -1;
     }
+
+    char *backups = getenv("MFS_REPLICAS");
+    if (backups != NULL && nshards == 0) {
+        replicas[0] = addrSnd;
+        int n = parse_hosts(backups, replicas + 1, MAX_REPLICAS);
+        if (n < 0) {
+            return -1;
+        }
+        nreplicas = n + 1;
+    }
+
+    // the server remembers replies by (address, port, seq); a client
+    // that gets the port of one that went away must not look like it
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    seq = ((unsigned int)getpid() * 2654435761u ^ (unsigned int)(tv.tv_sec * 1000000 + tv.tv_usec)) & 0x3fffffff;
+
+    rto_ms = DEFAULT_RTO_MS;
+    char *timeout = getenv("MFS_TIMEOUT_MS");
+    if (timeout != NULL && atoi(timeout) > 0) {
+        rto_ms = atoi(timeout);
+    }
     return 0;
 }
 
-int MFS_Lookup(int pinum, char *name){
+// a lookup reply also carries the child's type and size
+int lookup(int pinum, char *name, MFS_Stat_t *m){
     message_t request;
     request.mtype = MFS_LOOKUP;
-    request.inum = pinum;
+    request.inum = route(pinum, name);
     int name_len = strlen(name);
     if (name_len > 27 || name_len <=0) {
         // name too long/short
@@ -81,13 +358,8 @@ int MFS_Lookup(int pinum, char *name){
     }
     strcpy(request.name, name);
 
-    int rc = udp_send(&request);
-    if (rc < 0) {
-        return -1;
-    }
-
     message_t response;
-    rc = udp_receive(&response);
+    int rc = udp_call(&request, &response);
     if (rc < 0) {
         return -1;
     }
@@ -95,21 +367,47 @@ int MFS_Lookup(int pinum, char *name){
     if (response.rc < 0) {
         return -1;
     } else {
-        return response.inum;
+        m->type = response.type;
+        m->size = response.size;
+        return unroute(response.inum);
     }
 }
 
+int MFS_Lookup(int pinum, char *name){
+    MFS_Stat_t m;
+    return lookup(pinum, name, &m);
+}
+
+// the root is split over all shards: add up their entries, counting
+// "." and ".." once
+int stat_root(MFS_Stat_t *m) {
+    m->type = MFS_DIRECTORY;
+    m->size = 0;
+    for (int i = 0; i < nshards; i++) {
+        message_t request;
+        request.inum = 0;
+        request.mtype = MFS_STAT;
+        addrSnd = shards[i];
+
+        message_t response;
+        if (udp_call(&request, &response) < 0 || response.rc < 0) {
+            return -1;
+        }
+        m->size += i == 0 ? response.size : response.size - 2 * sizeof(MFS_DirEnt_t);
+    }
+    return 0;
+}
+
 int MFS_Stat(int inum, MFS_Stat_t *m){
+    if (inum == 0 && nshards > 0) {
+        return stat_root(m);
+    }
     message_t request;
-    request.inum = inum;
+    request.inum = route(inum, NULL);
     request.mtype = MFS_STAT;
 
-    int rc = udp_send(&request);
-    if (rc < 0) {
-        return -1;
-    }
     message_t response;
-    rc = udp_receive(&response);
+    int rc = udp_call(&request, &response);
     if (rc < 0) {
         return -1;
     }
@@ -123,25 +421,66 @@ int MFS_Stat(int inum, MFS_Stat_t *m){
     }
 }
 
+int MFS_LookupStat(int pinum, char *name, MFS_Stat_t *m){
+    int inum = lookup(pinum, name, m);
+    if (inum == 0 && nshards > 0 && stat_root(m) < 0) {
+        // ".." back up to the root, which this shard has only part of
+        return -1;
+    }
+    return inum;
+}
+
+int MFS_StatMany(int *inums, int n, MFS_Stat_t *stats){
+    int i = 0;
+    while (i < n) {
+        if (inums[i] == 0 && nshards > 0) {
+            if (stat_root(&stats[i]) < 0) {
+                return -1;
+            }
+            i++;
+            continue;
+        }
+        // as many as fit that live on the same server
+        message_t request;
+        request.mtype = MFS_STAT_MANY;
+        int *batch = (int*)request_data(&request);
+        int target = inums[i] >> MFS_SHARD_SHIFT;
+        int count = 0;
+        while (i + count < n && count < MFS_STAT_BATCH) {
+            int inum = inums[i + count];
+            if (nshards > 0 && (inum == 0 || inum >> MFS_SHARD_SHIFT != target)) {
+                break;
+            }
+            batch[count++] = route(inum, NULL);
+        }
+        request.nbytes = count * sizeof(int);
+
+        message_t response;
+        int rc = udp_call(&request, &response);
+        if (rc < 0 || response.rc < 0) {
+            return -1;
+        }
+        memcpy(stats + i, reply_data(&response), count * sizeof(MFS_Stat_t));
+        i += count;
+    }
+    return 0;
+}
+
 int MFS_Write(int inum, char *buffer, int offset, int nbytes){
-    if (nbytes <= 0 || nbytes > 4096) {
+    if (nbytes <= 0 || nbytes > max_io()) {
         // nbytes out of range
         return -1;
     }
     message_t request;
     request.mtype = MFS_WRITE;
-    request.inum = inum;
+    request.inum = route(inum, NULL);
     request.offset = offset;
     request.nbytes = nbytes;
 
-    memcpy(request.buffer, buffer, nbytes);
+    memcpy(request_data(&request), buffer, nbytes);
 
-    int rc = udp_send(&request);
-    if (rc < 0) {
-        return -1;
-    }
     message_t response;
-    rc = udp_receive(&response);
+    int rc = udp_call(&request, &response);
     if (rc < 0) {
         return -1;
     }
@@ -149,24 +488,105 @@ int MFS_Write(int inum, char *buffer, int offset, int nbytes){
     return response.rc;
 }
 
-int MFS_Read(int inum, char *buffer, int offset, int nbytes){
-    if (nbytes <= 0 || nbytes > 4096) {
+int MFS_Append(int inum, char *buffer, int nbytes){
+    if (nbytes <= 0 || nbytes > max_io()) {
         // nbytes out of range
         return -1;
     }
     message_t request;
-    request.mtype = MFS_READ;
-    request.inum = inum;
-    request.offset = offset;
+    request.mtype = MFS_APPEND;
+    request.inum = route(inum, NULL);
+    request.nbytes = nbytes;
+
+    memcpy(request_data(&request), buffer, nbytes);
+
+    message_t response;
+    int rc = udp_call(&request, &response);
+    if (rc < 0 || response.rc < 0) {
+        return -1;
+    }
+
+    return response.offset;
+}
+
+int MFS_Copy(int src_inum, int dst_pinum, char *name){
+    int name_len = strlen(name);
+    if (name_len > 27 || name_len <= 0) {
+        // name too long/short
+        return -1;
+    }
+    message_t request;
+    request.mtype = MFS_COPY;
+    int src = route(src_inum, NULL);
+    int src_shard = shard;
+    request.inum = route(dst_pinum, name);
+    if (src == -1 || request.inum == -1 || shard != src_shard) {
+        // both ends must be on one server
+        return -1;
+    }
+    request.type = src;
+    strcpy(request.name, name);
+
+    message_t response;
+    int rc = udp_call(&request, &response);
+    if (rc < 0 || response.rc < 0) {
+        return -1;
+    }
+
+    return unroute(response.inum);
+}
+
+int MFS_CopyRange(int src_inum, int src_offset, int dst_inum, int dst_offset, int nbytes){
+    message_t request;
+    request.mtype = MFS_COPY_RANGE;
+    int src = route(src_inum, NULL);
+    int src_shard = shard;
+    request.inum = route(dst_inum, NULL);
+    if (src == -1 || request.inum == -1 || shard != src_shard) {
+        // both ends must be on one server
+        return -1;
+    }
+    request.type = src;
+    request.size = src_offset;
+    request.offset = dst_offset;
     request.nbytes = nbytes;
 
-    int rc = udp_send(&request);
+    message_t response;
+    int rc = udp_call(&request, &response);
     if (rc < 0) {
         return -1;
     }
 
+    return response.rc;
+}
+
+// a directory read from a shard holds that shard's inums: make the
+// ones that lie wholly in the range global
+void unroute_entries(char *buffer, int offset, int nbytes) {
+    int size = sizeof(MFS_DirEnt_t);
+    int at = offsetof(MFS_DirEnt_t, inum);
+    for (int e = offset / size; e * size + at < offset + nbytes; e++) {
+        int pos = e * size + at - offset;
+        if (pos < 0 || pos + (int)sizeof(int) > nbytes) {
+            continue;
+        }
+        int inum;
+        memcpy(&inum, buffer + pos, sizeof(int));
+        inum = unroute(inum);
+        memcpy(buffer + pos, &inum, sizeof(int));
+    }
+}
+
+// MFS_Read of inum as the server picked by route() knows it
+int read_routed(int inum, char *buffer, int offset, int nbytes) {
+    message_t request;
+    request.mtype = MFS_READ;
+    request.inum = inum;
+    request.offset = offset;
+    request.nbytes = nbytes;
+
     message_t response;
-    rc = udp_receive(&response);
+    int rc = udp_call(&request, &response);
     if (rc < 0) {
         return -1;
     }
@@ -174,15 +594,61 @@ int MFS_Read(int inum, char *buffer, int offset, int nbytes){
     if (response.rc < 0) {
         return -1;
     } else {
-        memcpy(buffer, response.buffer, nbytes);
+        memcpy(buffer, reply_data(&response), nbytes);
+        if (nshards > 0 && response.type == MFS_DIRECTORY) {
+            unroute_entries(buffer, offset, nbytes);
+        }
         return 0;
     }
 }
 
+int MFS_Read(int inum, char *buffer, int offset, int nbytes){
+    if (nbytes <= 0 || nbytes > max_io()) {
+        // nbytes out of range
+        return -1;
+    }
+    return read_routed(route(inum, NULL), buffer, offset, nbytes);
+}
+
+int MFS_ReadDir(int inum, MFS_DirEnt_t *entries, int max){
+    // the root is split over all shards: every one's entries, with "."
+    // and ".." once
+    int rounds = inum == 0 && nshards > 0 ? nshards : 1;
+    int local = route(inum, NULL);
+    if (local == -1) {
+        return -1;
+    }
+    int n = 0;
+    for (int i = 0; i < rounds; i++) {
+        if (rounds > 1) {
+            shard = i;
+            addrSnd = shards[i];
+        }
+        // the block is MFS_BLOCK_SIZE or bigger (mkfs -b): read it a
+        // piece at a time until there's no more of it
+        MFS_DirEnt_t piece[MFS_BLOCK_SIZE / sizeof(MFS_DirEnt_t)];
+        for (int offset = 0; read_routed(local, (char *) piece, offset, sizeof(piece)) == 0; offset += sizeof(piece)) {
+            for (int e = 0; e < MFS_BLOCK_SIZE / sizeof(MFS_DirEnt_t); e++) {
+                if (piece[e].inum < 0) {
+                    continue;
+                }
+                if (i > 0 && (strcmp(piece[e].name, ".") == 0 || strcmp(piece[e].name, "..") == 0)) {
+                    continue;
+                }
+                if (n == max) {
+                    return n;
+                }
+                entries[n++] = piece[e];
+            }
+        }
+    }
+    return n;
+}
+
 int MFS_Creat(int pinum, int type, char *name){
     message_t request;
     request.mtype = MFS_CREAT;
-    request.inum = pinum;
+    request.inum = route(pinum, name);
     request.type = type;
 
     int name_len = strlen(name);
@@ -192,24 +658,76 @@ int MFS_Creat(int pinum, int type, char *name){
     }
     strcpy(request.name, name);
 
-    int rc = udp_send(&request);
+    message_t response;
+    int rc = udp_call(&request, &response);
     if (rc < 0) {
         return -1;
     }
 
+    return response.rc;
+}
+
+// send the names in pick (indices into names) as one request
+int creat_batch(int pinum, int type, char *names[], int *pick, int count, int *inums) {
+    message_t request;
+    request.mtype = MFS_CREAT_MANY;
+    request.inum = route(pinum, names[pick[0]]);
+    request.type = type;
+    char *packed = request_data(&request);
+    memset(packed, 0, count * sizeof(request.name));
+    for (int i = 0; i < count; i++) {
+        strcpy(packed + i * sizeof(request.name), names[pick[i]]);
+    }
+    request.nbytes = count * sizeof(request.name);
+
     message_t response;
-    rc = udp_receive(&response);
-    if (rc < 0) {
+    int rc = udp_call(&request, &response);
+    if (rc < 0 || response.rc < 0) {
         return -1;
     }
+    int *created = (int*)reply_data(&response);
+    for (int i = 0; i < count; i++) {
+        inums[pick[i]] = unroute(created[i]);
+    }
+    return 0;
+}
 
-    return response.rc;
+int MFS_CreatMany(int pinum, int type, char *names[], int n, int *inums){
+    for (int i = 0; i < n; i++) {
+        int name_len = strlen(names[i]);
+        if (name_len > 27 || name_len <= 0) {
+            // name too long/short
+            return -1;
+        }
+    }
+    // names in the root are spread over the shards: one round per shard
+    int rounds = pinum == 0 && nshards > 0 ? nshards : 1;
+    int pick[MFS_CREAT_BATCH];
+    for (int round = 0; round < rounds; round++) {
+        int count = 0;
+        for (int i = 0; i < n; i++) {
+            if (rounds > 1 && shard_of_name(names[i]) != round) {
+                continue;
+            }
+            pick[count++] = i;
+            if (count == MFS_CREAT_BATCH) {
+                if (creat_batch(pinum, type, names, pick, count, inums) < 0) {
+                    return -1;
+                }
+                count = 0;
+            }
+        }
+        if (count > 0 && creat_batch(pinum, type, names, pick, count, inums) < 0) {
+            return -1;
+        }
+    }
+    return 0;
 }
 
 int MFS_Unlink(int pinum, char *name){
     message_t request;
     request.mtype = MFS_UNLINK;
-    request.inum = pinum;
+    request.inum = route(pinum, name);
 
     int name_len = strlen(name);
     if (name_len > 27 || name_len <=0) {
@@ -218,13 +736,23 @@ int MFS_Unlink(int pinum, char *name){
     }
     strcpy(request.name, name);
 
-    int rc = udp_send(&request);
+    message_t response;
+    int rc = udp_call(&request, &response);
     if (rc < 0) {
         return -1;
     }
 
+    return response.rc;
+}
+
+int MFS_Truncate(int inum, int size){
+    message_t request;
+    request.mtype = MFS_TRUNCATE;
+    request.inum = route(inum, NULL);
+    request.size = size;
+
     message_t response;
-    rc = udp_receive(&response);
+    int rc = udp_call(&request, &response);
     if (rc < 0) {
         return -1;
     }
@@ -232,15 +760,143 @@ int MFS_Unlink(int pinum, char *name){
     return response.rc;
 }
 
+int MFS_Rename(int src_pinum, char *src_name, int dst_pinum, char *dst_name){
+    int src_len = strlen(src_name);
+    int dst_len = strlen(dst_name);
+    if (src_len > 27 || src_len <= 0 || dst_len > 27 || dst_len <= 0) {
+        // name too long/short
+        return -1;
+    }
+    message_t request;
+    request.mtype = MFS_RENAME;
+    int dst = route(dst_pinum, dst_name);
+    int dst_shard = shard;
+    request.inum = route(src_pinum, src_name);
+    if (dst == -1 || request.inum == -1 || shard != dst_shard) {
+        // a rename can't move things between servers
+        return -1;
+    }
+    request.offset = dst;
+    strcpy(request.name, src_name);
+    request.nbytes = dst_len + 1;
+    memcpy(request_data(&request), dst_name, dst_len + 1);
+
+    message_t response;
+    int rc = udp_call(&request, &response);
+    if (rc < 0) {
+        return -1;
+    }
+
+    return response.rc;
+}
+
+int MFS_Grow(int num_data){
+    message_t request;
+    request.mtype = MFS_GROW;
+    request.inum = 0;
+    request.size = num_data;
+
+    message_t response;
+    for (int i = 0; i == 0 || i < nshards; i++) {
+        if (nshards > 0) {
+            addrSnd = shards[i];
+        }
+        int rc = udp_call(&request, &response);
+        if (rc < 0 || response.rc < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int MFS_Shutdown(){
     message_t request;
     request.mtype = MFS_SHUTDOWN;
 
-    int rc = udp_send(&request);
-    if (rc < 0) {
+    if (chan != NULL) {
+        // no reply comes back
+        memcpy(&chan->request, &request, offsetof(message_t, buffer));
+        SHM_Post(chan, SHM_REQUEST);
+        SHM_Close(sd, chan);
+        chan = NULL;
+        return 0;
+    }
+    if (stream_buf != NULL) {
+        STREAM_Send(sd, (char *) &request, offsetof(message_t, buffer), NULL, 0);
+        close(sd);
+        free(stream_buf);
+        stream_buf = NULL;
+        return 0;
+    }
+
+    // every shard goes down
+    for (int i = 0; i < nshards; i++) {
+        addrSnd = shards[i];
+        if (udp_send(&request) < 0) {
+            return -1;
+        }
+    }
+    if (nreplicas > 0) {
+        // the server, not the replica that served the last read
+        addrSnd = replicas[0];
+    }
+    if (nshards == 0 && udp_send(&request) < 0) {
         return -1;
     }
 
     UDP_Close(sd);
     return 0;
-}
\ No newline at end of file
+}
+
+// percentiles of different servers can't be combined; keep the worst
+void merge_latency(MFS_Latency_t *dst, MFS_Latency_t *src) {
+    dst->count += src->count;
+    dst->total_ns += src->total_ns;
+    dst->p50_ns = src->p50_ns > dst->p50_ns ? src->p50_ns : dst->p50_ns;
+    dst->p99_ns = src->p99_ns > dst->p99_ns ? src->p99_ns : dst->p99_ns;
+    dst->p999_ns = src->p999_ns > dst->p999_ns ? src->p999_ns : dst->p999_ns;
+    dst->max_ns = src->max_ns > dst->max_ns ? src->max_ns : dst->max_ns;
+}
+
+void merge_stats(MFS_Stats_t *dst, MFS_Stats_t *src) {
+    dst->uptime_ms = src->uptime_ms > dst->uptime_ms ? src->uptime_ms : dst->uptime_ms;
+    dst->num_inodes += src->num_inodes;
+    dst->free_inodes += src->free_inodes;
+    dst->num_data += src->num_data;
+    dst->free_data += src->free_data;
+    // shards' images may differ; the largest
+    dst->block_size = src->block_size > dst->block_size ? src->block_size : dst->block_size;
+    for (int i = 0; i < MFS_STATS_OPS; i++) {
+        dst->errors[i] += src->errors[i];
+        merge_latency(&dst->ops[i], &src->ops[i]);
+    }
+    for (int i = 0; i < MFS_STATS_PHASES; i++) {
+        merge_latency(&dst->phases[i], &src->phases[i]);
+    }
+}
+
+int MFS_Stats(MFS_Stats_t *stats){
+    message_t request;
+    request.mtype = MFS_STATS;
+
+    message_t response;
+    memset(stats, 0, sizeof(MFS_Stats_t));
+    // all shards together
+    for (int i = 0; i == 0 || i < nshards; i++) {
+        if (nshards > 0) {
+            addrSnd = shards[i];
+        }
+        int rc = udp_call(&request, &response);
+        if (rc < 0) {
+            return -1;
+        }
+
+        if (response.rc < 0) {
+            return -1;
+        }
+        MFS_Stats_t one;
+        memcpy(&one, reply_data(&response), sizeof(MFS_Stats_t));
+        merge_stats(stats, &one);
+    }
+    return 0;
+}
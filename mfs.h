@@ -12,8 +12,37 @@
 #define MFS_UNLINK    6
 #define MFS_SHUTDOWN  7
 #define MFS_ERROR     8
+#define MFS_STATS     9
+#define MFS_REPLICATE 10 // a primary opening its link to a backup
+#define MFS_TRUNCATE  11
+#define MFS_RENAME    12
+#define MFS_APPEND    13
+#define MFS_COPY       14
+#define MFS_COPY_RANGE 15
+#define MFS_STAT_MANY  16
+#define MFS_CREAT_MANY 17
+#define MFS_RECLAIM    18 // free blocks of unlinked files; the server sends it itself
+#define MFS_GROW       19
+// requests that carry nbytes of data in buffer: what to write, the new
+// name of a rename, the inums to stat, the names to create
+#define MFS_HAS_BODY(mtype) ((mtype) == MFS_WRITE || (mtype) == MFS_APPEND || (mtype) == MFS_RENAME || \
+    (mtype) == MFS_STAT_MANY || (mtype) == MFS_CREAT_MANY)
 #define MFS_BUFFER    4096
+// an image's block size is MFS_BLOCK_SIZE unless it was made with a
+// bigger one (mkfs -b, up to MFS_MAX_BLOCK_SIZE); MFS_Stats tells
 #define MFS_BLOCK_SIZE   (4096)
+#define MFS_MAX_BLOCK_SIZE (65536)
+// largest MFS_Read/MFS_Write on a stream transport: a whole file at the
+// largest block size. on UDP and shm they are limited to MFS_BUFFER
+#define MFS_MAX_IO    (30 * MFS_MAX_BLOCK_SIZE)
+
+#define MFS_SHARD_SHIFT 24
+
+#define MFS_STAT_BATCH (MFS_BUFFER / 8)   // MFS_Stat_t per MFS_StatMany request
+#define MFS_CREAT_BATCH (MFS_BUFFER / 28) // names per MFS_CreatMany request
+
+// rc of a read sent to a backup (server -B) that has lost its primary
+#define MFS_STALE (-2)
 
 typedef struct __MFS_Stat_t {
     int type;   // MFS_DIRECTORY or MFS_REGULAR
@@ -26,9 +55,42 @@ typedef struct __MFS_DirEnt_t {
     int  inum;      // inode number of entry (-1 means entry not used)
 } MFS_DirEnt_t;
 
+// server metrics, returned by MFS_Stats. ops[] is indexed by mtype
+// (0 collects unknown types); latencies are in nanoseconds.
+#define MFS_STATS_OPS    32
+
+#define MFS_PHASE_QUEUE   0 // socket receive queue, kernel stamp to dequeue
+#define MFS_PHASE_DECODE  1
+#define MFS_PHASE_HANDLER 2 // excluding flush
+#define MFS_PHASE_FLUSH   3 // msync
+#define MFS_PHASE_SEND    4
+#define MFS_STATS_PHASES  5
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned long long p50_ns;
+    unsigned long long p99_ns;
+    unsigned long long p999_ns;
+    unsigned long long max_ns;
+} MFS_Latency_t;
+
+typedef struct {
+    unsigned long long uptime_ms;
+    int num_inodes;
+    int free_inodes;
+    int num_data;
+    int free_data;
+    int block_size;
+    unsigned long long errors[MFS_STATS_OPS];
+    MFS_Latency_t ops[MFS_STATS_OPS];       // receive to reply sent
+    MFS_Latency_t phases[MFS_STATS_PHASES]; // all ops together
+} MFS_Stats_t;
+
 typedef struct {
     int mtype;
     int rc;
+    int seq;    // echoed by the server so retries can be matched up
 
     int inum;
     int nbytes;
@@ -40,13 +102,75 @@ typedef struct {
     char buffer[4096];
 
 } message_t;
+// hostname "shm:<socket>" talks to a server on this host started with
+// -l <socket> over shared memory instead of UDP; port is then ignored.
+// "tcp:<host>" (server -T) and "unix:<socket>" (server -U) use a stream
+// connection, which allows reads and writes of up to MFS_MAX_IO bytes.
+// "shards:<host>:<port>,<host>:<port>,..." spreads the namespace over
+// several UDP servers, each with its own image: every top level name
+// lives on one shard (by hash) together with everything below it. the
+// shard is kept in the inum bits from MFS_SHARD_SHIFT up
 int MFS_Init(char *hostname, int port);
 int MFS_Lookup(int pinum, char *name);
 int MFS_Stat(int inum, MFS_Stat_t *m);
+// MFS_Lookup and MFS_Stat of what it found, in one round trip
+int MFS_LookupStat(int pinum, char *name, MFS_Stat_t *m);
+// stat n inodes in as few round trips as possible (up to
+// MFS_STAT_BATCH per request). an inode that isn't allocated gets type
+// -1. 0, or -1 if the server couldn't be reached
+int MFS_StatMany(int *inums, int n, MFS_Stat_t *stats);
 int MFS_Write(int inum, char *buffer, int offset, int nbytes);
 int MFS_Read(int inum, char *buffer, int offset, int nbytes);
+// the entries in use in directory inum, up to max of them: how many, or
+// -1. with shards, the root's are gathered from all of them
+int MFS_ReadDir(int inum, MFS_DirEnt_t *entries, int max);
 int MFS_Creat(int pinum, int type, char *name);
+// MFS_Creat of n names in one directory, MFS_CREAT_BATCH to a request;
+// each request creates all of its names or none. fills in inums and
+// returns 0, or -1 if a request failed
+int MFS_CreatMany(int pinum, int type, char *names[], int n, int *inums);
 int MFS_Unlink(int pinum, char *name);
+// set a regular file's size. blocks past the new end are freed; growing
+// it leaves a hole
+int MFS_Truncate(int inum, int size);
+// move src_name in directory src_pinum to dst_name in dst_pinum, in one
+// step. an existing dst_name is replaced if it's a file and src is a
+// file too, or an empty directory and src is a directory. with shards,
+// both names must be on the same shard
+int MFS_Rename(int src_pinum, char *src_name, int dst_pinum, char *dst_name);
+// write nbytes at the end of the file, whatever it is by the time the
+// server gets to it. returns the offset they went to, or -1. safe to
+// retransmit: the server remembers the reply
+int MFS_Append(int inum, char *buffer, int nbytes);
+// copy file src_inum to name in directory dst_pinum (overwriting a file
+// already there) without the data leaving the server. returns the
+// copy's inum, or -1
+int MFS_Copy(int src_inum, int dst_pinum, char *name);
+// copy nbytes at src_offset in src_inum to dst_offset in dst_inum,
+// on the server. the ranges may overlap
+int MFS_CopyRange(int src_inum, int src_offset, int dst_inum, int dst_offset, int nbytes);
+// grow the image (every shard's) to num_data data blocks while it's
+// being served. how far it can grow is fixed by mkfs -D
+int MFS_Grow(int num_data);
 int MFS_Shutdown();
+int MFS_Stats(MFS_Stats_t *stats);
+
+// requests are retransmitted when no reply comes back: first after
+// MFS_TIMEOUT_MS (environment, default 500) milliseconds, then backing
+// off up to 5s, giving up after 30s. most requests are idempotent, so a
+// retry is harmless. appends, renames and range copies are not: they are
+// safe only because of the server's duplicate reply cache, which sends a
+// retry of a client's last one of them the reply it already got, and
+// refuses older retries from the last DUP_WINDOW (1024) calls. returns
+// how many retransmits this thread has made.
+//
+// MFS_REPLICAS (environment, "host:port,...") names the backups of a
+// replicated server (server -b); lookups, stats and reads then go round
+// robin over the server and them. a backup has applied every mutation
+// acked to any client only if the server waits for all of them (no -q):
+// with a smaller quorum a read may miss the client's own last write. a
+// backup the server has dropped answers MFS_STALE, and the read goes to
+// the server instead
+long MFS_Retransmits();
 
 #endif // __MFS_h__
\ No newline at end of file
@@ -0,0 +1,101 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "ufs.h"
+#include "fsck.h"
+
+void usage() {
+    fprintf(stderr, "usage: mfsck -f <image_file> [-r] [-q] [-j <threads>]\n"
+        "  -r  repair problems in place\n"
+        "  -q  only print the summary\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    char *image_file = NULL;
+    int repair = 0;
+    int verbose = 1;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((ch = getopt(argc, argv, "f:rqj:")) != -1) {
+        switch (ch) {
+        case 'f':
+            image_file = optarg;
+            break;
+        case 'r':
+            repair = 1;
+            break;
+        case 'q':
+            verbose = 0;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (image_file == NULL) {
+        usage();
+    }
+
+    int fd = open(image_file, repair ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "image does not exist\n");
+        exit(1);
+    }
+    struct stat sbuf;
+    int rc = fstat(fd, &sbuf);
+    if (rc < 0) {
+        fprintf(stderr, "image does not exist\n");
+        exit(1);
+    }
+
+    // without -r the mapping is private, so nothing reaches the image
+    void *image = mmap(NULL, sbuf.st_size, PROT_READ | PROT_WRITE, repair ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    assert(image != MAP_FAILED);
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    fsck_result_t r;
+    long problems = fsck_image(image, sbuf.st_size, nthreads, repair, verbose, &r);
+
+    gettimeofday(&end, NULL);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+    if (problems < 0) {
+        exit(4);
+    }
+    if (repair) {
+        msync(image, sbuf.st_size, MS_SYNC);
+    }
+
+    printf("bad inodes        %ld\n", r.bad_inodes);
+    printf("bad pointers      %ld\n", r.bad_pointers);
+    printf("double allocated  %ld\n", r.double_blocks);
+    printf("missing blocks    %ld\n", r.missing_blocks);
+    printf("leaked blocks     %ld\n", r.leaked_blocks);
+    printf("dangling entries  %ld\n", r.dangling_entries);
+    printf("bad dir sizes     %ld\n", r.bad_dir_sizes);
+    printf("orphan inodes     %ld\n", r.orphan_inodes);
+    printf("unreachable       %ld\n", r.unreachable_inodes);
+    printf("bad pending runs  %ld\n", r.bad_pending);
+    printf("%ld problem(s)%s in %.3fs\n", problems, repair && problems > 0 ? " repaired" : "", secs);
+
+    munmap(image, sbuf.st_size);
+    close(fd);
+
+    // like fsck(8): 0 clean, 1 errors corrected, 4 errors left
+    if (problems == 0) {
+        return 0;
+    }
+    return repair ? 1 : 4;
+}
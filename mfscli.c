@@ -11,6 +11,7 @@
 
 #include "mfs.h"
 #include "ufs.h"
+#include "metrics.h"
 
 #define MFS_RW_BUFFER_SIZE 4096
 #define LOG_SIZE 4096
@@ -92,34 +93,39 @@ int perform_ls(char *path) {
         sprintf(logBuffer, "The inode (%d) received for %s is not of directory type", dirInode, path); ERR();
     }
 
-    int sz = stat.size;
-    assert(sz % sizeof(MFS_DirEnt_t) == 0);
-    int nentries = sz / sizeof(MFS_DirEnt_t);
-    MFS_DirEnt_t entries[nentries]; // should be safe to pass to MFS_Read because struct seems packed. No padding should be necessary.
+    // a directory is one block of entries, some of them free; size only
+    // counts the ones in use
+    int nslots = stat.size / sizeof(MFS_DirEnt_t);
+    MFS_DirEnt_t *entries = malloc(nslots * sizeof(MFS_DirEnt_t)); // should be safe to pass to MFS_ReadDir because struct seems packed. No padding should be necessary.
 
-    assert(sizeof(entries) == (28+4)*nentries); // folks, students, if this assert fails, email me!
+    assert(sizeof(MFS_DirEnt_t) == 28+4); // folks, students, if this assert fails, email me!
     // Future me: the solution would be to read in X bytes specifically, and explicitly force-read entries by casting at required offsets.
 
-    sprintf(logBuffer, "Attempting to read %d children of %s", nentries, path); VERBOSE();
+    sprintf(logBuffer, "Attempting to read %d children of %s", nslots, path); VERBOSE();
 
-    int offset = 0;
-    while (offset < sz) {
-        int toRead = sz - offset;
-        if (toRead > MFS_RW_BUFFER_SIZE) toRead = MFS_RW_BUFFER_SIZE;
-        rc = MFS_Read(dirInode, entries, offset, toRead);
-        if (rc == -1) {
-            sprintf(logBuffer, "MFS_Read failed"); ERR();
-        }
-        offset += toRead;
+    int nentries = MFS_ReadDir(dirInode, entries, nslots);
+    if (nentries < 0) {
+        sprintf(logBuffer, "MFS_ReadDir failed"); ERR();
+    }
+
+    // then everything in it, in one go
+    int *inums = malloc(nentries * sizeof(int));
+    for (int i = 0; i < nentries; i++) {
+        inums[i] = entries[i].inum;
+    }
+    MFS_Stat_t *stats = malloc(nentries * sizeof(MFS_Stat_t));
+    if (MFS_StatMany(inums, nentries, stats) == -1) {
+        sprintf(logBuffer, "MFS_StatMany failed"); ERR();
     }
 
     sprintf(logBuffer, "Fetched %d children. Here they are!", nentries); INFO();
     for(int i = 0; i < nentries; i++) {
-        if (entries[i].inum < 0)
-            printf("Skipping entry: (inode=%d)", entries[i].inum);
-        else
-            printf("%s (inode=%d)\n", entries[i].name, entries[i].inum);
+        printf("%s (inode=%d, %s, %d bytes)\n", entries[i].name, entries[i].inum,
+            stats[i].type == MFS_DIRECTORY ? "dir" : stats[i].type == MFS_REGULAR_FILE ? "file" : "?", stats[i].size);
     }
+    free(entries);
+    free(inums);
+    free(stats);
     return 0;
 }
 
@@ -234,22 +240,16 @@ int perform_cat(char *path) {
 
     int dirInode = _traverseToDirectory(dirPath);
 
-    int fileInode = MFS_Lookup(dirInode, fileName);
+    // the lookup brings the size along
+    MFS_Stat_t stat;
+    int fileInode = MFS_LookupStat(dirInode, fileName, &stat);
     if (fileInode == -1) {
         sprintf(logBuffer, "Unable to lookup file %s in directory (inum=%d)", fileName, dirInode); ERR();
     }
 
-    sprintf(logBuffer, "Trying to determine filesize"); VERBOSE();
-
-    MFS_Stat_t stat;
-    int rc = MFS_Stat(fileInode, &stat);
-    if (rc == -1) {
-        sprintf(logBuffer, "Unable to determine filesize. Stat failed for inum=%d", fileInode); ERR();
-    }
-
     int sz = stat.size;
-    char *output = (char *) malloc(sz * sizeof(char));
-    memset(output, 0, sz);
+    char *output = (char *) malloc(sz + 1);
+    memset(output, 0, sz + 1);
     
     sprintf(logBuffer, "Filesize=%d. Starting read", sz); INFO();
 
@@ -267,8 +267,10 @@ int perform_cat(char *path) {
         offset += count;
     }
 
-    sprintf(logBuffer, "File contents (from next line): \n%s\n", output);
-    INFO();
+    // may not fit in logBuffer
+    printf("[INFO] File contents (from next line): \n");
+    fwrite(output, 1, sz, stdout);
+    printf("\n");
 
     free(output);
     free(dirPath);
@@ -316,6 +318,96 @@ int perform_mkdir(char *path) {
     return 0;
 }
 
+int perform_truncate(char *path, int size) {
+    int fnameSep = rfind(path, '/');
+    char *dirPath = strndup(path, fnameSep);
+    char *fileName = path + fnameSep + 1;
+
+    int dirInode = _traverseToDirectory(dirPath);
+    int fileInode = MFS_Lookup(dirInode, fileName);
+    if (fileInode == -1) {
+        sprintf(logBuffer, "Unable to lookup file %s in directory (inum=%d)", fileName, dirInode); ERR();
+    }
+    if (MFS_Truncate(fileInode, size) == -1) {
+        sprintf(logBuffer, "MFS_Truncate failed for inum=%d size=%d", fileInode, size); ERR();
+    }
+    sprintf(logBuffer, "truncate completed successfully"); INFO();
+    free(dirPath);
+    return 0;
+}
+
+int perform_mv(char *src, char *dst) {
+    int srcSep = rfind(src, '/');
+    char *srcDirPath = strndup(src, srcSep);
+    int dstSep = rfind(dst, '/');
+    char *dstDirPath = strndup(dst, dstSep);
+
+    int srcDirInode = _traverseToDirectory(srcDirPath);
+    int dstDirInode = _traverseToDirectory(dstDirPath);
+    if (MFS_Rename(srcDirInode, src + srcSep + 1, dstDirInode, dst + dstSep + 1) == -1) {
+        sprintf(logBuffer, "MFS_Rename failed for %s -> %s", src, dst); ERR();
+    }
+    sprintf(logBuffer, "mv completed successfully"); INFO();
+    free(srcDirPath);
+    free(dstDirPath);
+    return 0;
+}
+
+int perform_cp(char *src, char *dst) {
+    int srcSep = rfind(src, '/');
+    char *srcDirPath = strndup(src, srcSep);
+    int dstSep = rfind(dst, '/');
+    char *dstDirPath = strndup(dst, dstSep);
+
+    int srcDirInode = _traverseToDirectory(srcDirPath);
+    int srcInode = MFS_Lookup(srcDirInode, src + srcSep + 1);
+    if (srcInode == -1) {
+        sprintf(logBuffer, "Unable to lookup file %s in directory (inum=%d)", src + srcSep + 1, srcDirInode); ERR();
+    }
+    int dstDirInode = _traverseToDirectory(dstDirPath);
+    if (MFS_Copy(srcInode, dstDirInode, dst + dstSep + 1) == -1) {
+        sprintf(logBuffer, "MFS_Copy failed for %s -> %s", src, dst); ERR();
+    }
+    sprintf(logBuffer, "cp completed successfully"); INFO();
+    free(srcDirPath);
+    free(dstDirPath);
+    return 0;
+}
+
+int perform_stats() {
+    MFS_Stats_t stats;
+    int rc = MFS_Stats(&stats);
+    if (rc == -1) {
+        sprintf(logBuffer, "MFS_Stats failed"); ERR();
+    }
+
+    printf("uptime       %llu ms\n", stats.uptime_ms);
+    printf("inodes       %d free of %d\n", stats.free_inodes, stats.num_inodes);
+    printf("data blocks  %d free of %d, %d bytes each\n", stats.free_data, stats.num_data, stats.block_size);
+    printf("\n%-10s %10s %8s %10s %10s %10s %10s\n", "op", "count", "errors", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for (int i = 0; i < MFS_STATS_OPS; i++) {
+        MFS_Latency_t *l = &stats.ops[i];
+        if (l->count == 0) continue;
+        printf("%-10s %10llu %8llu %10.1f %10.1f %10.1f %10.1f\n", metrics_op_name(i), l->count, stats.errors[i],
+            l->p50_ns / 1e3, l->p99_ns / 1e3, l->p999_ns / 1e3, l->max_ns / 1e3);
+    }
+    printf("\n%-10s %10s %8s %10s %10s %10s %10s\n", "phase", "count", "", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for (int i = 0; i < MFS_STATS_PHASES; i++) {
+        MFS_Latency_t *l = &stats.phases[i];
+        printf("%-10s %10llu %8s %10.1f %10.1f %10.1f %10.1f\n", metrics_phase_name(i), l->count, "",
+            l->p50_ns / 1e3, l->p99_ns / 1e3, l->p999_ns / 1e3, l->max_ns / 1e3);
+    }
+    return 0;
+}
+
+int perform_grow(int num_data) {
+    if (MFS_Grow(num_data) == -1) {
+        sprintf(logBuffer, "MFS_Grow failed for %d data blocks", num_data); ERR();
+    }
+    sprintf(logBuffer, "grow completed successfully"); INFO();
+    return 0;
+}
+
 const char *usage =  "mfscli usage: \n"
     "Basic format: ./mfscli ip_of_server port <command> <args...>\n"
     "              If the server is on the same machine, use 127.0.0.1 as ip\n"
@@ -347,6 +439,28 @@ const char *usage =  "mfscli usage: \n"
     "       it and so on. Existing directories would ideally remain untouched \n"
     "       because MFS_Creat doesn't do anything and returns true for existing dirs\n"
     "\n"
+    " - ./mfscli 127.0.0.1 36000 truncate /files/test1.txt 100 \n"
+    "       Sets the size of /files/test1.txt (MFS_Truncate). Blocks past the \n"
+    "       new end are freed; growing the file leaves a hole of zeros.\n"
+    "\n"
+    " - ./mfscli 127.0.0.1 36000 mv /files/test1.txt /other/test2.txt \n"
+    "       Similar to UNIX mv, in a single MFS_Rename: no data is copied. \n"
+    "       Replaces the destination if it's a file (or an empty directory \n"
+    "       when moving a directory).\n"
+    "\n"
+    " - ./mfscli 127.0.0.1 36000 cp /files/test1.txt /other/test2.txt \n"
+    "       Similar to UNIX cp, for a file. The server copies it (MFS_Copy); \n"
+    "       no data goes over the network.\n"
+    "\n"
+    " - ./mfscli 127.0.0.1 36000 grow 8192 \n"
+    "       Grows the image to 8192 data blocks while the server keeps \n"
+    "       serving (MFS_Grow). The image must have been made with room \n"
+    "       for it (mkfs -D).\n"
+    "\n"
+    " - ./mfscli 127.0.0.1 36000 stats \n"
+    "       Prints the server's per-op counters, latency percentiles and free \n"
+    "       inode/block counts (MFS_Stats).\n"
+    "\n"
     ;
 
 int _assert_argc(int argc, int expected) {
@@ -388,6 +502,21 @@ int main(int argc, char *argv[]) {
     } else if (strcmp(cmd, "unlink") == 0) {
         _assert_argc(argc, 2 + 3);
         perform_unlink(argv[4]);
+    } else if (strcmp(cmd, "truncate") == 0) {
+        _assert_argc(argc, 3 + 3);
+        perform_truncate(argv[4], atoi(argv[5]));
+    } else if (strcmp(cmd, "mv") == 0) {
+        _assert_argc(argc, 3 + 3);
+        perform_mv(argv[4], argv[5]);
+    } else if (strcmp(cmd, "cp") == 0) {
+        _assert_argc(argc, 3 + 3);
+        perform_cp(argv[4], argv[5]);
+    } else if (strcmp(cmd, "grow") == 0) {
+        _assert_argc(argc, 2 + 3);
+        perform_grow(atoi(argv[4]));
+    } else if (strcmp(cmd, "stats") == 0) {
+        _assert_argc(argc, 1 + 3);
+        perform_stats();
     } else {
         printf("Command not found! run ./mfscli for usage help\n");
         return -1;
@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ufs.h"
+#include "fsck.h"
+
+// offline compaction: moves the data blocks in use down into the free
+// ones below them, so the data region (the last thing in the image) can
+// be cut short and the file truncated. free blocks that are left are
+// punched out of the file. the server must not be running, and backups
+// need a fresh copy afterwards.
+
+char *img;
+super_t *sb;
+unsigned int *dbits;
+inode_t *inodes;
+int block_size;
+
+unsigned int get_bit(unsigned int *bitmap, int position) {
+    int index = position / 32;
+    int offset = 31 - (position % 32);
+    return (bitmap[index] >> offset) & 0x1;
+}
+
+void set_bit(unsigned int *bitmap, int position, int value) {
+    int index = position / 32;
+    int offset = 31 - (position % 32);
+    if (value == 1) {
+        bitmap[index] |= 0x1 << offset;
+    } else if (value == 0) {
+        bitmap[index] &= ~(0x1 << offset);
+    }
+}
+
+char *block_ptr(int addr) {
+    return img + (long)addr * block_size;
+}
+
+void usage() {
+    fprintf(stderr, "usage: mfscompact -f <image_file> [-s <spare_blocks>] [-n]\n"
+        "  -s  free data blocks to keep after the live ones (default 32)\n"
+        "  -n  only report what would be done\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    char *image_file = NULL;
+    int spare = 32;
+    int dry_run = 0;
+
+    while ((ch = getopt(argc, argv, "f:s:n")) != -1) {
+        switch (ch) {
+        case 'f':
+            image_file = optarg;
+            break;
+        case 's':
+            spare = atoi(optarg);
+            break;
+        case 'n':
+            dry_run = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (image_file == NULL || spare < 0) {
+        usage();
+    }
+
+    int fd = open(image_file, dry_run ? O_RDONLY : O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "image does not exist\n");
+        exit(1);
+    }
+    struct stat sbuf;
+    int rc = fstat(fd, &sbuf);
+    if (rc < 0) {
+        fprintf(stderr, "image does not exist\n");
+        exit(1);
+    }
+
+    // with -n the mapping is private, so nothing reaches the image
+    void *image = mmap(NULL, sbuf.st_size, PROT_READ | PROT_WRITE, dry_run ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    assert(image != MAP_FAILED);
+
+    // moving blocks around a damaged image would only make it worse
+    fsck_result_t r;
+    long problems = fsck_image(image, sbuf.st_size, sysconf(_SC_NPROCESSORS_ONLN), 0, 1, &r);
+    if (problems != 0) {
+        fprintf(stderr, "mfscompact: image has problems, run mfsck -r first\n");
+        exit(1);
+    }
+
+    img = (char*)image;
+    sb = (super_t*)image;
+    block_size = UFS_BLOCK_SIZE_OF(sb);
+    dbits = (unsigned int*)block_ptr(sb->data_bitmap_addr);
+    inodes = (inode_t*)block_ptr(sb->inode_region_addr);
+    unsigned int *ibits = (unsigned int*)block_ptr(sb->inode_bitmap_addr);
+
+    // blocks still waiting for the server's reclaimer are free already
+    ufs_pending_t *pending = UFS_PENDING(image);
+    for (int i = 0; i < pending->num_runs; i++) {
+        for (int b = 0; b < pending->runs[i].len; b++) {
+            set_bit(dbits, pending->runs[i].start - sb->data_region_addr + b, 0);
+        }
+    }
+    pending->num_runs = 0;
+
+    // which direct[] entry points at each block: inum * DIRECT_PTRS + slot
+    int *owner = malloc(sb->num_data * sizeof(int));
+    assert(owner != NULL);
+    memset(owner, 0xff, sb->num_data * sizeof(int));
+    for (int inum = 0; inum < sb->num_inodes; inum++) {
+        if (get_bit(ibits, inum) != 1 || (inodes[inum].type & UFS_INLINE)) {
+            continue;
+        }
+        for (int b = 0; b < DIRECT_PTRS; b++) {
+            if ((int)inodes[inum].direct[b] != -1) {
+                owner[inodes[inum].direct[b] - sb->data_region_addr] = inum * DIRECT_PTRS + b;
+            }
+        }
+    }
+
+    // fill the lowest free block with the highest used one until they meet
+    int moved = 0;
+    int lo = 0;
+    int hi = sb->num_data - 1;
+    while (1) {
+        while (lo < sb->num_data && get_bit(dbits, lo) == 1) {
+            lo++;
+        }
+        while (hi >= 0 && get_bit(dbits, hi) == 0) {
+            hi--;
+        }
+        if (lo >= hi) {
+            break;
+        }
+        memcpy(block_ptr(lo + sb->data_region_addr), block_ptr(hi + sb->data_region_addr), block_size);
+        inodes[owner[hi] / DIRECT_PTRS].direct[owner[hi] % DIRECT_PTRS] = lo + sb->data_region_addr;
+        owner[lo] = owner[hi];
+        set_bit(dbits, lo, 1);
+        set_bit(dbits, hi, 0);
+        moved++;
+    }
+    free(owner);
+
+    int live = hi + 1;
+    int old_data = sb->num_data;
+    int new_data = live + spare < old_data ? live + spare : old_data;
+    long old_size = sbuf.st_size;
+    long data_start = (long)sb->data_region_addr * block_size;
+    long new_size = data_start + (long)new_data * block_size;
+
+    printf("%d live data blocks, %d moved\n", live, moved);
+    printf("data region %d -> %d blocks, image %ld -> %ld bytes%s\n", old_data, new_data, old_size, new_size,
+        dry_run ? " (dry run)" : "");
+    if (dry_run) {
+        munmap(image, sbuf.st_size);
+        close(fd);
+        return 0;
+    }
+
+    sb->num_data = new_data;
+    sb->data_region_len = new_data;
+    rc = msync(image, sbuf.st_size, MS_SYNC);
+    assert(rc == 0);
+    munmap(image, sbuf.st_size);
+
+    if (ftruncate(fd, new_size) < 0) {
+        perror("mfscompact: ftruncate");
+        exit(1);
+    }
+    // the spare blocks kept at the end hold nothing worth keeping
+    if (new_data > live) {
+        long start = data_start + (long)live * block_size;
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, new_size - start) < 0) {
+            perror("mfscompact: can't punch holes in the image");
+        }
+    }
+    fsync(fd);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ufs.h"
+
+// offline access to a file system image: no server needed.
+// the image is mapped read-only, so it is safe to run against an
+// image that a server is currently serving.
+
+#define MAX_WORKERS 64
+#define PATH_LEN 4096
+
+typedef struct {
+    unsigned int bits[UFS_BLOCK_SIZE / sizeof(unsigned int)];
+} bitmap_t;
+
+// dir_slots of them, as many as fit in a block
+typedef struct {
+    dir_ent_t entries[0];
+} dir_block_t;
+
+int image_fd;
+void *image;
+int image_size;
+
+super_t *s;
+int block_size;
+int dir_slots;
+bitmap_t *inode_bitmap;
+bitmap_t *data_bitmap;
+inode_t *itable;
+
+int use_copy_range = 1;
+
+// work queue of directories still to be extracted
+typedef struct work {
+    int inum;
+    char path[PATH_LEN];
+    struct work *next;
+} work_t;
+
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+work_t *queue_head;
+int queue_pending; // queued + being processed
+int errors;
+
+// totals, updated under queue_lock
+long long total_files;
+long long total_dirs;
+long long total_bytes;
+
+void usage() {
+    fprintf(stderr, "usage: mfsdump -f <image_file> [-j <workers>] <command> [args]\n"
+        "  ls <path>                list a directory\n"
+        "  stat <path>              print type, size and blocks of an entry\n"
+        "  cat <path>               write a file's contents to stdout\n"
+        "  extract <path> <dir>     copy a subtree (or / for everything) to <dir>\n");
+    exit(1);
+}
+
+unsigned int get_bit(unsigned int *bitmap, int position) {
+    int index = position / 32;
+    int offset = 31 - (position % 32);
+    return (bitmap[index] >> offset) & 0x1;
+}
+
+char *block_ptr(int addr) {
+    return (char*)image + (long)addr * block_size;
+}
+
+// is addr an allocated block of the data region?
+int valid_data_block(int addr) {
+    int index = addr - s->data_region_addr;
+    if (index < 0 || index >= s->num_data) {
+        return 0;
+    }
+    return get_bit(data_bitmap->bits, index) == 1;
+}
+
+int valid_inode(int inum) {
+    if (inum < 0 || inum >= s->num_inodes) {
+        return 0;
+    }
+    return get_bit(inode_bitmap->bits, inum) == 1;
+}
+
+// find name in directory pinum, -1 if not there
+int dir_lookup(int pinum, char *name) {
+    inode_t *dir = &itable[pinum];
+    for (int b = 0; b < DIRECT_PTRS; b++) {
+        int addr = (int)dir->direct[b];
+        if (addr == -1 || !valid_data_block(addr)) {
+            continue;
+        }
+        dir_block_t *block = (dir_block_t*)block_ptr(addr);
+        for (int i = 0; i < dir_slots; i++) {
+            if (block->entries[i].inum == -1) {
+                continue;
+            }
+            if (strncmp(block->entries[i].name, name, 28) == 0) {
+                return block->entries[i].inum;
+            }
+        }
+    }
+    return -1;
+}
+
+// walk an absolute path from the root, -1 if any component is missing
+int resolve(char *path) {
+    char *copy = strdup(path);
+    int inum = 0;
+    char *save;
+    for (char *name = strtok_r(copy, "/", &save); name != NULL; name = strtok_r(NULL, "/", &save)) {
+        if (!valid_inode(inum) || itable[inum].type != UFS_DIRECTORY) {
+            inum = -1;
+            break;
+        }
+        inum = dir_lookup(inum, name);
+        if (inum == -1) {
+            break;
+        }
+    }
+    free(copy);
+    if (inum != -1 && !valid_inode(inum)) {
+        return -1;
+    }
+    return inum;
+}
+
+int file_blocks(inode_t *inode) {
+    if (inode->type & UFS_INLINE) {
+        return 0;
+    }
+    int n = 0;
+    for (int b = 0; b < DIRECT_PTRS; b++) {
+        if ((int)inode->direct[b] != -1) {
+            n++;
+        }
+    }
+    return n;
+}
+
+int perform_ls(char *path) {
+    int inum = resolve(path);
+    if (inum == -1) {
+        fprintf(stderr, "mfsdump: %s: not found\n", path);
+        return -1;
+    }
+    if (itable[inum].type != UFS_DIRECTORY) {
+        fprintf(stderr, "mfsdump: %s: not a directory\n", path);
+        return -1;
+    }
+    for (int b = 0; b < DIRECT_PTRS; b++) {
+        int addr = (int)itable[inum].direct[b];
+        if (addr == -1 || !valid_data_block(addr)) {
+            continue;
+        }
+        dir_block_t *block = (dir_block_t*)block_ptr(addr);
+        for (int i = 0; i < dir_slots; i++) {
+            dir_ent_t *e = &block->entries[i];
+            if (e->inum == -1) {
+                continue;
+            }
+            if (!valid_inode(e->inum)) {
+                printf("?    %10s %6d %.28s\n", "-", e->inum, e->name);
+                continue;
+            }
+            printf("%s %10d %6d %.28s\n", itable[e->inum].type == UFS_DIRECTORY ? "dir " : "file",
+                itable[e->inum].size, e->inum, e->name);
+        }
+    }
+    return 0;
+}
+
+int perform_stat(char *path) {
+    int inum = resolve(path);
+    if (inum == -1) {
+        fprintf(stderr, "mfsdump: %s: not found\n", path);
+        return -1;
+    }
+    inode_t *inode = &itable[inum];
+    printf("inum    %d\n", inum);
+    printf("type    %s\n", inode->type == UFS_DIRECTORY ? "directory" : "regular file");
+    printf("size    %d\n", inode->size);
+    if (inode->type & UFS_INLINE) {
+        printf("blocks  0 (inline)\n");
+        return 0;
+    }
+    printf("blocks  %d\n", file_blocks(inode));
+    printf("direct ");
+    for (int b = 0; b < DIRECT_PTRS; b++) {
+        if ((int)inode->direct[b] != -1) {
+            printf(" %d", (int)inode->direct[b]);
+        }
+    }
+    printf("\n");
+    return 0;
+}
+
+// copy len bytes at image offset src to out_fd at offset dst.
+// tries copy_file_range first (no trip through user space), then
+// falls back to a plain write out of the mapping.
+int copy_out(int out_fd, long src, long dst, long len) {
+    while (len > 0) {
+        ssize_t rc = -1;
+        if (use_copy_range) {
+            loff_t in_off = src;
+            loff_t out_off = dst;
+            rc = copy_file_range(image_fd, &in_off, out_fd, &out_off, len, 0);
+            if (rc < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                use_copy_range = 0;
+                continue;
+            }
+        } else {
+            rc = pwrite(out_fd, (char*)image + src, len, dst);
+        }
+        if (rc <= 0) {
+            return -1;
+        }
+        src += rc;
+        dst += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+// write the contents of file inum to out_fd. physically contiguous
+// blocks are coalesced so large files go out in few big copies.
+int dump_file(int inum, int out_fd) {
+    inode_t *inode = &itable[inum];
+    long size = inode->size;
+    if (size > (long)DIRECT_PTRS * block_size) {
+        size = (long)DIRECT_PTRS * block_size;
+    }
+    int nblocks = (size + block_size - 1) / block_size;
+
+    if (inode->type & UFS_INLINE) {
+        if (size > UFS_INLINE_MAX) {
+            size = UFS_INLINE_MAX;
+        }
+        if (size > 0 && write(out_fd, inode->direct, size) != size) {
+            return -1;
+        }
+        nblocks = 0;
+    }
+
+    int b = 0;
+    while (b < nblocks) {
+        int addr = (int)inode->direct[b];
+        if (addr == -1 || !valid_data_block(addr)) {
+            // nothing stored here, leave a hole
+            b++;
+            continue;
+        }
+        int run = 1;
+        while (b + run < nblocks && (int)inode->direct[b + run] == addr + run && valid_data_block(addr + run)) {
+            run++;
+        }
+        long start = (long)b * block_size;
+        long len = (long)run * block_size;
+        if (start + len > size) {
+            len = size - start;
+        }
+        if (copy_out(out_fd, (long)addr * block_size, start, len) < 0) {
+            return -1;
+        }
+        b += run;
+    }
+    if (ftruncate(out_fd, size) < 0 && out_fd != STDOUT_FILENO) {
+        return -1;
+    }
+    return 0;
+}
+
+int perform_cat(char *path) {
+    int inum = resolve(path);
+    if (inum == -1) {
+        fprintf(stderr, "mfsdump: %s: not found\n", path);
+        return -1;
+    }
+    if (UFS_TYPE(itable[inum].type) != UFS_REGULAR_FILE) {
+        fprintf(stderr, "mfsdump: %s: not a regular file\n", path);
+        return -1;
+    }
+    inode_t *inode = &itable[inum];
+    if (inode->type & UFS_INLINE) {
+        fwrite(inode->direct, 1, inode->size > UFS_INLINE_MAX ? UFS_INLINE_MAX : inode->size, stdout);
+        return 0;
+    }
+    for (int b = 0; b * block_size < inode->size && b < DIRECT_PTRS; b++) {
+        int len = inode->size - b * block_size;
+        if (len > block_size) {
+            len = block_size;
+        }
+        int addr = (int)inode->direct[b];
+        if (addr == -1 || !valid_data_block(addr)) {
+            static const char zero[UFS_MAX_BLOCK_SIZE];
+            fwrite(zero, 1, len, stdout);
+        } else {
+            fwrite(block_ptr(addr), 1, len, stdout);
+        }
+    }
+    return 0;
+}
+
+void push_work(int inum, char *path) {
+    work_t *w = malloc(sizeof(work_t));
+    assert(w != NULL);
+    w->inum = inum;
+    snprintf(w->path, PATH_LEN, "%s", path);
+
+    pthread_mutex_lock(&queue_lock);
+    w->next = queue_head;
+    queue_head = w;
+    queue_pending++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void report_error(char *what, char *path) {
+    pthread_mutex_lock(&queue_lock);
+    fprintf(stderr, "mfsdump: %s %s: %s\n", what, path, strerror(errno));
+    errors++;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// extract one directory: files are written here, subdirectories are
+// queued so that other workers can pick them up.
+void extract_dir(work_t *w) {
+    if (mkdir(w->path, 0755) < 0 && errno != EEXIST) {
+        report_error("mkdir", w->path);
+        return;
+    }
+    long long files = 0, bytes = 0;
+
+    inode_t *dir = &itable[w->inum];
+    for (int b = 0; b < DIRECT_PTRS; b++) {
+        int addr = (int)dir->direct[b];
+        if (addr == -1 || !valid_data_block(addr)) {
+            continue;
+        }
+        dir_block_t *block = (dir_block_t*)block_ptr(addr);
+        for (int i = 0; i < dir_slots; i++) {
+            dir_ent_t *e = &block->entries[i];
+            if (e->inum == -1) {
+                continue;
+            }
+            char name[29];
+            memcpy(name, e->name, 28);
+            name[28] = '\0';
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            if (!valid_inode(e->inum) || strchr(name, '/') != NULL) {
+                fprintf(stderr, "mfsdump: skipping bad entry %s/%s (inum=%d)\n", w->path, name, e->inum);
+                continue;
+            }
+
+            char path[PATH_LEN];
+            if (snprintf(path, PATH_LEN, "%s/%s", w->path, name) >= PATH_LEN) {
+                fprintf(stderr, "mfsdump: path too long, skipping %s/%s\n", w->path, name);
+                continue;
+            }
+            if (itable[e->inum].type == UFS_DIRECTORY) {
+                push_work(e->inum, path);
+                continue;
+            }
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                report_error("open", path);
+                continue;
+            }
+            if (dump_file(e->inum, fd) < 0) {
+                report_error("write", path);
+            }
+            close(fd);
+            files++;
+            bytes += itable[e->inum].size;
+        }
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    total_dirs++;
+    total_files += files;
+    total_bytes += bytes;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void *worker(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL && queue_pending > 0) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        if (queue_head == NULL) {
+            // nothing queued and nobody working: done
+            pthread_cond_broadcast(&queue_cond);
+            pthread_mutex_unlock(&queue_lock);
+            return NULL;
+        }
+        work_t *w = queue_head;
+        queue_head = w->next;
+        pthread_mutex_unlock(&queue_lock);
+
+        extract_dir(w);
+        free(w);
+
+        pthread_mutex_lock(&queue_lock);
+        queue_pending--;
+        if (queue_pending == 0) {
+            pthread_cond_broadcast(&queue_cond);
+        }
+        pthread_mutex_unlock(&queue_lock);
+    }
+}
+
+int perform_extract(char *path, char *dest, int nworkers) {
+    int inum = resolve(path);
+    if (inum == -1) {
+        fprintf(stderr, "mfsdump: %s: not found\n", path);
+        return -1;
+    }
+
+    if (UFS_TYPE(itable[inum].type) == UFS_REGULAR_FILE) {
+        int fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("open");
+            return -1;
+        }
+        int rc = dump_file(inum, fd);
+        close(fd);
+        return rc;
+    }
+
+    push_work(inum, dest);
+
+    pthread_t threads[MAX_WORKERS];
+    for (int i = 0; i < nworkers; i++) {
+        int rc = pthread_create(&threads[i], NULL, worker, NULL);
+        assert(rc == 0);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("extracted %lld directories, %lld files, %lld bytes\n", total_dirs, total_files, total_bytes);
+    return errors == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    char *image_file = NULL;
+    int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((ch = getopt(argc, argv, "f:j:")) != -1) {
+        switch (ch) {
+        case 'f':
+            image_file = optarg;
+            break;
+        case 'j':
+            nworkers = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (image_file == NULL || argc < 1) {
+        usage();
+    }
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+    if (nworkers > MAX_WORKERS) {
+        nworkers = MAX_WORKERS;
+    }
+
+    image_fd = open(image_file, O_RDONLY);
+    if (image_fd < 0) {
+        fprintf(stderr, "image does not exist\n");
+        exit(1);
+    }
+    struct stat sbuf;
+    if (fstat(image_fd, &sbuf) < 0 || sbuf.st_size < UFS_BLOCK_SIZE) {
+        fprintf(stderr, "image is too small\n");
+        exit(1);
+    }
+    image_size = (int) sbuf.st_size;
+
+    image = mmap(NULL, image_size, PROT_READ, MAP_SHARED, image_fd, 0);
+    assert(image != MAP_FAILED);
+
+    s = (super_t*) image;
+    block_size = UFS_BLOCK_SIZE_OF(s);
+    if (!UFS_VALID_BLOCK_SIZE(block_size)) {
+        fprintf(stderr, "image has an unsupported block size (%d)\n", block_size);
+        exit(1);
+    }
+    dir_slots = block_size / sizeof(dir_ent_t);
+    long total_blocks = 1L + s->inode_bitmap_len + s->data_bitmap_len + s->inode_region_len + s->data_region_len;
+    if (total_blocks * block_size > image_size) {
+        fprintf(stderr, "image is truncated (%ld blocks in super block)\n", total_blocks);
+        exit(1);
+    }
+    inode_bitmap = (bitmap_t*) block_ptr(s->inode_bitmap_addr);
+    data_bitmap = (bitmap_t*) block_ptr(s->data_bitmap_addr);
+    itable = (inode_t*) block_ptr(s->inode_region_addr);
+
+    char *cmd = argv[0];
+    int rc;
+    if (strcmp(cmd, "ls") == 0 && argc == 2) {
+        rc = perform_ls(argv[1]);
+    } else if (strcmp(cmd, "stat") == 0 && argc == 2) {
+        rc = perform_stat(argv[1]);
+    } else if (strcmp(cmd, "cat") == 0 && argc == 2) {
+        rc = perform_cat(argv[1]);
+    } else if (strcmp(cmd, "extract") == 0 && argc == 3) {
+        rc = perform_extract(argv[1], argv[2], nworkers);
+    } else {
+        usage();
+        rc = -1;
+    }
+
+    munmap(image, image_size);
+    close(image_fd);
+    return rc == 0 ? 0 : 1;
+}
@@ -8,7 +8,9 @@
 #include "ufs.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-D <max_data_blocks>] [-b <block_size>]\n"
+        "  -b  block size in bytes, a power of two from 4096 (the default) to 65536\n"
+        "  -D  leave room in the data bitmap to grow the image online (MFS_Grow) to this many data blocks\n");
     exit(1);
 }
 
@@ -17,9 +19,11 @@ int main(int argc, char *argv[]) {
     char *image_file = NULL;
     int num_inodes = 32;
     int num_data = 32;
+    int max_data = 0;
+    int block_size = UFS_BLOCK_SIZE;
     int visual = 0;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:vD:b:")) != -1) {
 	switch (ch) {
 	case 'i':
 	    num_inodes = atoi(optarg);
@@ -27,6 +31,12 @@ int main(int argc, char *argv[]) {
 	case 'd':
 	    num_data = atoi(optarg);
 	    break;
+	case 'D':
+	    max_data = atoi(optarg);
+	    break;
+	case 'b':
+	    block_size = atoi(optarg);
+	    break;
 	case 'f':
 	    image_file = optarg;
 	    break;
@@ -40,11 +50,11 @@ int main(int argc, char *argv[]) {
     argc -= optind;
     argv += optind;
 
-    if (image_file == NULL)
+    if (image_file == NULL || !UFS_VALID_BLOCK_SIZE(block_size))
 	usage();
 
     unsigned char *empty_buffer;
-    empty_buffer = calloc(UFS_BLOCK_SIZE, 1);
+    empty_buffer = calloc(block_size, 1);
     if (empty_buffer == NULL) {
 	perror("calloc");
 	exit(1);
@@ -65,9 +75,10 @@ int main(int argc, char *argv[]) {
     // totals
     s.num_inodes = num_inodes;
     s.num_data = num_data;
+    s.block_size = block_size;
 
     // inode bitmap
-    int bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
+    int bits_per_block = (8 * block_size); // remember, there are 8 bits per byte
 
     s.inode_bitmap_addr = 1;
     s.inode_bitmap_len = num_inodes / bits_per_block;
@@ -76,15 +87,19 @@ int main(int argc, char *argv[]) {
 
     // data bitmap
     s.data_bitmap_addr = s.inode_bitmap_addr + s.inode_bitmap_len;
-    s.data_bitmap_len = num_data / bits_per_block;
-    if (num_data % bits_per_block != 0)
+    // the data region is last in the image, so it can grow for as long as
+    // the bitmap has bits for it
+    if (max_data < num_data)
+	max_data = num_data;
+    s.data_bitmap_len = max_data / bits_per_block;
+    if (max_data % bits_per_block != 0)
 	s.data_bitmap_len++;
 
     // inode table
     s.inode_region_addr = s.data_bitmap_addr + s.data_bitmap_len;
     int total_inode_bytes = num_inodes * sizeof(inode_t);
-    s.inode_region_len = total_inode_bytes / UFS_BLOCK_SIZE;
-    if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
+    s.inode_region_len = total_inode_bytes / block_size;
+    if (total_inode_bytes % block_size != 0)
 	s.inode_region_len++;
 
     // data blocks
@@ -100,7 +115,7 @@ int main(int argc, char *argv[]) {
 	exit(1);
     }
 
-    printf("total blocks        %d\n", total_blocks);
+    printf("total blocks        %d [size of each: %d]\n", total_blocks, block_size);
     printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
     printf("  inodes address          %d \n", s.inode_region_addr);
     printf("  data blocks       %d\n", num_data);
@@ -111,8 +126,8 @@ int main(int argc, char *argv[]) {
     // first, zero out all the blocks
     int i;
     for (i = 1; i < total_blocks; i++) {
-	rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
-	if (rc != UFS_BLOCK_SIZE) {
+	rc = pwrite(fd, empty_buffer, block_size, (off_t)i * block_size);
+	if (rc != block_size) {
 	    perror("write");
 	    exit(1);
 	}
@@ -121,65 +136,53 @@ int main(int argc, char *argv[]) {
     //
     // need to allocate first inode in inode bitmap
     //
-    typedef struct {
-	unsigned int bits[UFS_BLOCK_SIZE / sizeof(unsigned int)];
-    } bitmap_t;
-    assert(sizeof(bitmap_t) == UFS_BLOCK_SIZE);
-
-    bitmap_t b;
-    for (i = 0; i < 1024; i++)
-	b.bits[i] = 0;
-    b.bits[0] = 0x1 << 31; // first entry is allocated
+    unsigned int *b = calloc(block_size, 1);
+    assert(b != NULL);
+    b[0] = 0x1 << 31; // first entry is allocated
     
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.inode_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    rc = pwrite(fd, b, block_size, (off_t)s.inode_bitmap_addr * block_size);
+    assert(rc == block_size);
 
     //
     // need to allocate first data block in data bitmap
     // (can just reuse this to write out data bitmap too)
     //
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.data_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    rc = pwrite(fd, b, block_size, (off_t)s.data_bitmap_addr * block_size);
+    assert(rc == block_size);
 
     //
     // need to write out inode
     //
-    typedef struct {
-	inode_t inodes[UFS_BLOCK_SIZE / sizeof(inode_t)];
-    } inode_block;
-
-    inode_block itable;
-    itable.inodes[0].type = UFS_DIRECTORY;
-    itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
-    itable.inodes[0].direct[0] = s.data_region_addr;
+    inode_t *itable = calloc(block_size, 1);
+    assert(itable != NULL);
+    itable[0].type = UFS_DIRECTORY;
+    itable[0].size = 2 * sizeof(dir_ent_t); // in bytes
+    itable[0].direct[0] = s.data_region_addr;
     for (i = 1; i < DIRECT_PTRS; i++)
-	itable.inodes[0].direct[i] = -1;
+	itable[0].direct[i] = -1;
 
-    rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    rc = pwrite(fd, itable, block_size, (off_t)s.inode_region_addr * block_size);
+    assert(rc == block_size);
 
     // 
     // need to write out root directory contents to first data block
-    // create a root directory, with nothing in it
+    // create a root directory, with nothing in it: a block's worth of
+    // 32 byte entries
     // 
-    typedef struct {
-	dir_ent_t entries[128];
-    } dir_block_t;
-    // xxx assumes 4096 block, 32 byte entries
-    assert(sizeof(dir_ent_t) * 128 == UFS_BLOCK_SIZE);
-
-    dir_block_t parent;
-    strcpy(parent.entries[0].name, ".");
-    parent.entries[0].inum = 0;
+    int dir_slots = block_size / sizeof(dir_ent_t);
+    dir_ent_t *parent = calloc(block_size, 1);
+    assert(parent != NULL);
+    strcpy(parent[0].name, ".");
+    parent[0].inum = 0;
 
-    strcpy(parent.entries[1].name, "..");
-    parent.entries[1].inum = 0;
+    strcpy(parent[1].name, "..");
+    parent[1].inum = 0;
 
-    for (i = 2; i < 128; i++)
-	parent.entries[i].inum = -1;
+    for (i = 2; i < dir_slots; i++)
+	parent[i].inum = -1;
 
-    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    rc = pwrite(fd, parent, block_size, (off_t)s.data_region_addr * block_size);
+    assert(rc == block_size);
 
     if (visual) {
 	int i;
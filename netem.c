@@ -0,0 +1,276 @@
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include "udp.h"
+
+// impairment proxy: sits between clients and a server and drops,
+// delays, duplicates and reorders datagrams in both directions.
+//
+//   ./server 36000 fs.img &
+//   ./netem -l 5 -d 2 36001 127.0.0.1 36000 &
+//   ./bench -w mixed 127.0.0.1 36001
+//
+// each client gets its own upstream socket, so replies find their way
+// back. all randomness comes from -S, so a run can be repeated exactly.
+
+#define MAX_CLIENTS 1024
+#define MAX_PACKET 65536
+#define IDLE_NS (60 * 1000000000ULL) // forget clients after this
+
+typedef struct {
+    struct sockaddr_in addr; // client
+    int fd;                  // upstream socket for this client
+    unsigned long long last;
+} client_t;
+
+typedef struct {
+    unsigned long long due;
+    unsigned long long order; // keeps equal due times in arrival order
+    int fd;
+    struct sockaddr_in to;
+    int len;
+    char *data;
+} packet_t;
+
+// impairments, all percentages apply per datagram and direction
+double loss;         // -l percent dropped
+double delay_ms;     // -d fixed one-way delay
+double jitter_ms;    // -j uniform extra delay in [0, jitter)
+double duplicate;    // -u percent sent twice
+double reorder;      // -r percent held back so later ones overtake
+double reorder_ms = 5; // -g how long a reordered datagram is held
+unsigned int seed = 1;
+
+struct sockaddr_in server_addr;
+int listen_fd;
+client_t clients[MAX_CLIENTS];
+int nclients;
+
+packet_t *heap;
+int heap_len;
+int heap_cap;
+unsigned long long arrivals;
+
+// counters, printed on exit
+long forwarded, dropped, duplicated, reordered;
+
+unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+double chance() {
+    return 100.0 * rand_r(&seed) / ((double)RAND_MAX + 1);
+}
+
+int before(packet_t *a, packet_t *b) {
+    return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+void heap_push(packet_t p) {
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap == 0 ? 256 : 2 * heap_cap;
+        heap = realloc(heap, heap_cap * sizeof(packet_t));
+        assert(heap != NULL);
+    }
+    int i = heap_len++;
+    heap[i] = p;
+    while (i > 0 && before(&heap[i], &heap[(i - 1) / 2])) {
+        packet_t t = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = t;
+        i = (i - 1) / 2;
+    }
+}
+
+packet_t heap_pop() {
+    packet_t top = heap[0];
+    heap[0] = heap[--heap_len];
+    int i = 0;
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < heap_len && before(&heap[l], &heap[m])) m = l;
+        if (r < heap_len && before(&heap[r], &heap[m])) m = r;
+        if (m == i) break;
+        packet_t t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+    return top;
+}
+
+// queue a datagram for fd -> to, applying the impairments
+void impair(int fd, struct sockaddr_in *to, char *data, int len) {
+    if (chance() < loss) {
+        dropped++;
+        return;
+    }
+    int copies = 1;
+    if (chance() < duplicate) {
+        duplicated++;
+        copies = 2;
+    }
+    for (int c = 0; c < copies; c++) {
+        double ms = delay_ms;
+        if (jitter_ms > 0) {
+            ms += jitter_ms * chance() / 100.0;
+        }
+        if (chance() < reorder) {
+            reordered++;
+            ms += reorder_ms;
+        }
+        packet_t p;
+        p.due = now_ns() + (unsigned long long)(ms * 1e6);
+        p.order = arrivals++;
+        p.fd = fd;
+        p.to = *to;
+        p.len = len;
+        p.data = malloc(len);
+        assert(p.data != NULL);
+        memcpy(p.data, data, len);
+        heap_push(p);
+    }
+}
+
+// send everything that is due, return ms until the next one (-1: none)
+int flush_due() {
+    while (heap_len > 0) {
+        unsigned long long t = now_ns();
+        if (heap[0].due > t) {
+            return (int)((heap[0].due - t + 999999) / 1000000);
+        }
+        packet_t p = heap_pop();
+        if (UDP_Write(p.fd, &p.to, p.data, p.len) >= 0) {
+            forwarded++;
+        }
+        free(p.data);
+    }
+    return -1;
+}
+
+client_t *find_client(struct sockaddr_in *addr) {
+    unsigned long long t = now_ns();
+    for (int i = 0; i < nclients; i++) {
+        if (clients[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr && clients[i].addr.sin_port == addr->sin_port) {
+            clients[i].last = t;
+            return &clients[i];
+        }
+    }
+    // reuse the slot of a client that went quiet, if the table is full
+    int slot = nclients;
+    if (nclients == MAX_CLIENTS) {
+        slot = 0;
+        for (int i = 1; i < nclients; i++) {
+            if (clients[i].last < clients[slot].last) {
+                slot = i;
+            }
+        }
+        if (t - clients[slot].last < IDLE_NS) {
+            return NULL;
+        }
+        UDP_Close(clients[slot].fd);
+    } else {
+        nclients++;
+    }
+    clients[slot].addr = *addr;
+    clients[slot].fd = UDP_Open(0);
+    clients[slot].last = t;
+    if (clients[slot].fd < 0) {
+        clients[slot] = clients[--nclients];
+        return NULL;
+    }
+    return &clients[slot];
+}
+
+void report(int sig) {
+    fprintf(stderr, "netem: forwarded %ld, dropped %ld, duplicated %ld, reordered %ld\n",
+        forwarded, dropped, duplicated, reordered);
+    exit(0);
+}
+
+void usage() {
+    fprintf(stderr, "usage: netem [options] <listen-port> <server-host> <server-port>\n"
+        "  -l <pct>  drop this percentage of datagrams\n"
+        "  -d <ms>   delay every datagram by this much\n"
+        "  -j <ms>   add a uniformly random extra delay up to this much\n"
+        "  -u <pct>  duplicate this percentage of datagrams\n"
+        "  -r <pct>  reorder this percentage of datagrams\n"
+        "  -g <ms>   how long a reordered datagram is held back (default 5)\n"
+        "  -S <seed> random seed (default 1)\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    while ((ch = getopt(argc, argv, "l:d:j:u:r:g:S:")) != -1) {
+        switch (ch) {
+        case 'l': loss = atof(optarg); break;
+        case 'd': delay_ms = atof(optarg); break;
+        case 'j': jitter_ms = atof(optarg); break;
+        case 'u': duplicate = atof(optarg); break;
+        case 'r': reorder = atof(optarg); break;
+        case 'g': reorder_ms = atof(optarg); break;
+        case 'S': seed = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 3) {
+        usage();
+    }
+
+    listen_fd = UDP_Open(atoi(argv[0]));
+    assert(listen_fd > -1);
+    if (UDP_FillSockAddr(&server_addr, argv[1], atoi(argv[2])) < 0) {
+        exit(1);
+    }
+    signal(SIGINT, report);
+    signal(SIGTERM, report);
+
+    char *buffer = malloc(MAX_PACKET);
+    struct pollfd fds[MAX_CLIENTS + 1];
+    while (1) {
+        int timeout = flush_due();
+
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < nclients; i++) {
+            fds[i + 1].fd = clients[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        int n = nclients;
+        if (poll(fds, n + 1, timeout) <= 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            struct sockaddr_in from;
+            int len = UDP_Read(listen_fd, &from, buffer, MAX_PACKET);
+            client_t *c = len > 0 ? find_client(&from) : NULL;
+            if (c != NULL) {
+                impair(c->fd, &server_addr, buffer, len);
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            if (!(fds[i + 1].revents & POLLIN)) {
+                continue;
+            }
+            struct sockaddr_in from;
+            int len = UDP_Read(fds[i + 1].fd, &from, buffer, MAX_PACKET);
+            if (len > 0) {
+                // the client table may have shifted; look up by fd
+                for (int j = 0; j < nclients; j++) {
+                    if (clients[j].fd == fds[i + 1].fd) {
+                        impair(listen_fd, &clients[j].addr, buffer, len);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
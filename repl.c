@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "repl.h"
+#include "udp.h"
+
+#define MAX_BACKUPS 16
+// a send to a backup that stalls this long drops it: sends happen under
+// the server's fs_lock
+#define SEND_TIMEOUT 2 // seconds
+
+typedef struct {
+    char name[256];
+    int fd;
+    int live;
+    unsigned long long acked; // highest lsn it has applied
+} backup_t;
+
+static backup_t backups[MAX_BACKUPS];
+static int nbackups;
+static int quorum;
+static unsigned long long last_lsn;
+
+static pthread_mutex_t repl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ack_cond = PTHREAD_COND_INITIALIZER;
+// eventfds of loops that don't block in repl_wait (repl_watch)
+static int *watchers;
+static int nwatchers;
+
+// under repl_lock: an ack came in or a backup dropped
+static void notify(void) {
+    pthread_cond_broadcast(&ack_cond);
+    uint64_t one = 1;
+    for (int i = 0; i < nwatchers; i++) {
+        if (write(watchers[i], &one, sizeof(one)) < 0) {
+            // only when its counter is full: the loop will wake anyway
+        }
+    }
+}
+
+static void drop(backup_t *b, char *why) {
+    pthread_mutex_lock(&repl_lock);
+    if (b->live) {
+        fprintf(stderr, "server:: backup %s dropped: %s\n", b->name, why);
+        b->live = 0;
+        shutdown(b->fd, SHUT_RDWR);
+    }
+    notify();
+    pthread_mutex_unlock(&repl_lock);
+}
+
+// reads acks from one backup
+static void *ack_reader(void *arg) {
+    backup_t *b = (backup_t*)arg;
+    message_t response;
+    char *body = malloc(MFS_MAX_IO);
+    while (1) {
+        if (STREAM_Recv(b->fd, (char *) &response, offsetof(message_t, buffer), body, MFS_MAX_IO) < 0) {
+            drop(b, "connection lost");
+            break;
+        }
+        if (response.rc < 0) {
+            // it no longer matches the primary
+            drop(b, "failed to apply a mutation");
+            break;
+        }
+        pthread_mutex_lock(&repl_lock);
+        b->acked = response.seq;
+        notify();
+        pthread_mutex_unlock(&repl_lock);
+    }
+    free(body);
+    return NULL;
+}
+
+int repl_connect(char *list, int q) {
+    char *copy = strdup(list);
+    char *save;
+    for (char *entry = strtok_r(copy, ",", &save); entry != NULL; entry = strtok_r(NULL, ",", &save)) {
+        backup_t *b = &backups[nbackups];
+        char *colon = strrchr(entry, ':');
+        if (colon == NULL || nbackups == MAX_BACKUPS) {
+            fprintf(stderr, "server:: bad backup %s\n", entry);
+            free(copy);
+            return -1;
+        }
+        snprintf(b->name, sizeof(b->name), "%s", entry);
+        *colon = '\0';
+        b->fd = STREAM_ConnectTCP(entry, atoi(colon + 1));
+        if (b->fd < 0) {
+            fprintf(stderr, "server:: can't reach backup %s\n", b->name);
+            free(copy);
+            return -1;
+        }
+
+        // the hello turns this connection into a replication link
+        message_t hello, response;
+        memset(&hello, 0, sizeof(hello));
+        hello.mtype = MFS_REPLICATE;
+        char body[sizeof(MFS_Stats_t)];
+        if (STREAM_Send(b->fd, (char *) &hello, offsetof(message_t, buffer), NULL, 0) < 0 ||
+            STREAM_Recv(b->fd, (char *) &response, offsetof(message_t, buffer), body, sizeof(body)) < 0 ||
+            response.rc < 0) {
+            fprintf(stderr, "server:: %s is not a backup (-B)\n", b->name);
+            free(copy);
+            return -1;
+        }
+        struct timeval timeout = { SEND_TIMEOUT, 0 };
+        setsockopt(b->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        b->live = 1;
+        nbackups++;
+
+        pthread_t thread;
+        int rc = pthread_create(&thread, NULL, ack_reader, b);
+        assert(rc == 0);
+    }
+    free(copy);
+    quorum = q <= 0 || q > nbackups ? nbackups : q;
+    return 0;
+}
+
+unsigned long long repl_ship(message_t *request) {
+    message_t head;
+    memcpy(&head, request, offsetof(message_t, buffer));
+    head.seq = ++last_lsn;
+    int body = MFS_HAS_BODY(request->mtype) ? request->nbytes : 0;
+    for (int i = 0; i < nbackups; i++) {
+        if (backups[i].live && STREAM_Send(backups[i].fd, (char *) &head, offsetof(message_t, buffer), request->buffer, body) < 0) {
+            drop(&backups[i], "send failed");
+        }
+    }
+    return head.seq;
+}
+
+int repl_ready(void) {
+    pthread_mutex_lock(&repl_lock);
+    int live = 0;
+    for (int i = 0; i < nbackups; i++) {
+        live += backups[i].live;
+    }
+    pthread_mutex_unlock(&repl_lock);
+    return live >= quorum;
+}
+
+// under repl_lock
+static int check(unsigned long long lsn) {
+    int live = 0, acked = 0;
+    for (int i = 0; i < nbackups; i++) {
+        live += backups[i].live;
+        acked += backups[i].live && backups[i].acked >= lsn;
+    }
+    if (acked >= quorum) {
+        return 1;
+    }
+    // too many dropped out for a quorum to ever ack it
+    return live < quorum ? -1 : 0;
+}
+
+int repl_wait(unsigned long long lsn) {
+    pthread_mutex_lock(&repl_lock);
+    int rc;
+    while ((rc = check(lsn)) == 0) {
+        pthread_cond_wait(&ack_cond, &repl_lock);
+    }
+    pthread_mutex_unlock(&repl_lock);
+    return rc < 0 ? -1 : 0;
+}
+
+int repl_acked(unsigned long long lsn) {
+    pthread_mutex_lock(&repl_lock);
+    int rc = check(lsn);
+    pthread_mutex_unlock(&repl_lock);
+    return rc;
+}
+
+void repl_watch(int fd) {
+    pthread_mutex_lock(&repl_lock);
+    watchers = realloc(watchers, (nwatchers + 1) * sizeof(int));
+    assert(watchers != NULL);
+    watchers[nwatchers++] = fd;
+    pthread_mutex_unlock(&repl_lock);
+}
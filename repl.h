@@ -0,0 +1,39 @@
+#ifndef __REPL_h__
+#define __REPL_h__
+
+#include "mfs.h"
+
+// primary side of primary-backup replication (server -b).
+//
+// the primary keeps a TCP connection to each backup (a server started
+// with -B) and ships every mutation it applied down it, in the order it
+// applied them, as an ordinary stream request whose seq is its log
+// sequence number. the backup applies it with the same handlers, flushes
+// and replies, which is the ack. backups must start from a copy of the
+// primary's image: both then allocate the same inodes and blocks.
+
+// connect to "host:port,host:port,...", wait for acks from quorum of
+// them (0 = all). -1 if a backup can't be reached
+int repl_connect(char *backups, int quorum);
+
+// ship an applied mutation; call in apply order (under fs_lock).
+// returns its log sequence number
+unsigned long long repl_ship(message_t *request);
+
+// 1 if at least a quorum of backups are still connected, so a mutation
+// applied now can be acked
+int repl_ready(void);
+
+// block until a quorum of backups have applied lsn: 0. backups that drop
+// out are left behind; -1 once fewer than a quorum are left
+int repl_wait(unsigned long long lsn);
+
+// repl_wait without the wait: 1 if a quorum applied lsn, -1 if one never
+// will, 0 if it may yet
+int repl_acked(unsigned long long lsn);
+
+// for event loops that can't block in repl_wait: fd (an eventfd) is
+// written to whenever repl_acked may have changed
+void repl_watch(int fd);
+
+#endif // __REPL_h__
@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "mfs.h"
+#include "trace.h"
+
+// re-issues a trace recorded with server -t against a server.
+//
+// requests go out in recorded order from one connection, so a replay
+// against a copy of the image the trace started from is deterministic.
+// inode numbers are translated through what lookups return, which keeps
+// the replay on track even if the target image allocates differently.
+// write payloads aren't in the trace; a fixed pattern is written instead.
+
+#define MAX_INODES (1 << 20)
+
+int *inum_map; // recorded inum -> replayed inum, -1 = same number
+
+int map_inum(int inum) {
+    if (inum < 0 || inum >= MAX_INODES || inum_map[inum] == -1) {
+        return inum;
+    }
+    return inum_map[inum];
+}
+
+void learn_inum(int recorded, int replayed) {
+    if (recorded >= 0 && recorded < MAX_INODES && replayed >= 0) {
+        inum_map[recorded] = replayed;
+    }
+}
+
+unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int compare(const void *a, const void *b) {
+    unsigned long long x = *(unsigned long long*)a, y = *(unsigned long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// issue one recorded request, returns the rc the server gave
+int issue(trace_rec_t *rec) {
+    char buffer[MFS_BUFFER];
+    int nbytes = rec->nbytes;
+    if (nbytes < 0) {
+        nbytes = 0;
+    }
+    if (nbytes > MFS_BUFFER) {
+        nbytes = MFS_BUFFER;
+    }
+    char name[28];
+    memcpy(name, rec->name, sizeof(name));
+    name[sizeof(name) - 1] = '\0';
+
+    int rc;
+    switch (rec->mtype) {
+    case MFS_LOOKUP:
+        rc = MFS_Lookup(map_inum(rec->inum), name);
+        if (rc >= 0 && rec->rc == 0) {
+            learn_inum(rec->result, rc);
+        }
+        return rc < 0 ? -1 : 0;
+    case MFS_STAT: {
+        MFS_Stat_t st;
+        return MFS_Stat(map_inum(rec->inum), &st);
+    }
+    case MFS_WRITE:
+        for (int i = 0; i < nbytes; i++) {
+            buffer[i] = 'a' + (rec->offset + i) % 26;
+        }
+        return MFS_Write(map_inum(rec->inum), buffer, rec->offset, nbytes);
+    case MFS_COPY:
+        rc = MFS_Copy(map_inum(rec->type), map_inum(rec->inum), name);
+        if (rc >= 0 && rec->rc == 0) {
+            learn_inum(rec->result, rc);
+        }
+        return rc < 0 ? -1 : 0;
+    case MFS_COPY_RANGE:
+        // nbytes here is not a buffer size, no need to cap it
+        return MFS_CopyRange(map_inum(rec->type), rec->result, map_inum(rec->inum), rec->offset, rec->nbytes);
+    case MFS_APPEND:
+        for (int i = 0; i < nbytes; i++) {
+            buffer[i] = 'a' + (rec->offset + i) % 26;
+        }
+        return MFS_Append(map_inum(rec->inum), buffer, nbytes) < 0 ? -1 : 0;
+    case MFS_READ:
+        return MFS_Read(map_inum(rec->inum), buffer, rec->offset, nbytes);
+    case MFS_CREAT:
+        return MFS_Creat(map_inum(rec->inum), rec->type, name);
+    case MFS_UNLINK:
+        return MFS_Unlink(map_inum(rec->inum), name);
+    case MFS_TRUNCATE:
+        return MFS_Truncate(map_inum(rec->inum), rec->offset);
+    case MFS_RENAME: {
+        char new_name[28];
+        memcpy(new_name, rec->new_name, sizeof(new_name));
+        new_name[sizeof(new_name) - 1] = '\0';
+        return MFS_Rename(map_inum(rec->inum), name, map_inum(rec->offset), new_name);
+    }
+    case MFS_STATS: {
+        MFS_Stats_t stats;
+        return MFS_Stats(&stats);
+    }
+    }
+    return -1;
+}
+
+void usage() {
+    fprintf(stderr, "usage: replay [-x speed] [-S] [-v] <trace-file> <host> <port>\n"
+        "  -x  speed up (2 = twice as fast); 0 issues requests back to back (default 1)\n"
+        "  -S  also replay MFS_Shutdown requests\n"
+        "  -v  print every request whose result differs from the trace\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    double speed = 1;
+    int shutdown = 0;
+    int verbose = 0;
+    while ((ch = getopt(argc, argv, "x:Sv")) != -1) {
+        switch (ch) {
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'S':
+            shutdown = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 3 || speed < 0) {
+        usage();
+    }
+
+    FILE *f = fopen(argv[0], "r");
+    if (f == NULL) {
+        perror("replay: open");
+        exit(1);
+    }
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        fprintf(stderr, "replay: %s is not a trace\n", argv[0]);
+        exit(1);
+    }
+
+    // load it all up front so reading the file doesn't skew timing
+    long count = 0, cap = 4096;
+    trace_rec_t *recs = malloc(cap * sizeof(trace_rec_t));
+    assert(recs != NULL);
+    while (fread(&recs[count], sizeof(trace_rec_t), 1, f) == 1) {
+        if (++count == cap) {
+            cap *= 2;
+            recs = realloc(recs, cap * sizeof(trace_rec_t));
+            assert(recs != NULL);
+        }
+    }
+    fclose(f);
+
+    inum_map = malloc(MAX_INODES * sizeof(int));
+    assert(inum_map != NULL);
+    memset(inum_map, 0xff, MAX_INODES * sizeof(int));
+
+    if (MFS_Init(argv[1], atoi(argv[2])) < 0) {
+        fprintf(stderr, "replay: MFS_Init failed\n");
+        exit(1);
+    }
+
+    unsigned long long *latency = malloc((count + 1) * sizeof(unsigned long long));
+    assert(latency != NULL);
+    long issued = 0, mismatches = 0, late = 0;
+    unsigned long long start = now_ns();
+
+    for (long i = 0; i < count; i++) {
+        trace_rec_t *rec = &recs[i];
+        if (rec->mtype == MFS_SHUTDOWN) {
+            if (shutdown) {
+                MFS_Shutdown();
+                break;
+            }
+            continue;
+        }
+
+        if (speed > 0) {
+            unsigned long long due = start + (unsigned long long)(rec->ts_ns / speed);
+            unsigned long long t = now_ns();
+            if (due > t) {
+                struct timespec ts = { (due - t) / 1000000000ULL, (due - t) % 1000000000ULL };
+                nanosleep(&ts, NULL);
+            } else if (t - due > 1000000) {
+                late++; // more than 1ms behind schedule
+            }
+        }
+
+        unsigned long long t0 = now_ns();
+        int rc = issue(rec);
+        latency[issued++] = now_ns() - t0;
+
+        int ok = (rc < 0) == (rec->rc < 0);
+        if (!ok) {
+            mismatches++;
+            if (verbose) {
+                struct in_addr addr = { rec->client_addr };
+                fprintf(stderr, "replay: #%ld mtype %d inum %d name %.28s from %s:%d: recorded rc %d, got %d\n",
+                    i, rec->mtype, rec->inum, rec->name, inet_ntoa(addr), ntohs(rec->client_port), rec->rc, rc);
+            }
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    double recorded = count > 0 ? recs[count - 1].ts_ns / 1e9 : 0;
+    qsort(latency, issued, sizeof(unsigned long long), compare);
+
+    printf("requests     %ld replayed of %ld recorded\n", issued, count);
+    printf("mismatches   %ld (result differs from the trace)\n", mismatches);
+    printf("late         %ld (issued more than 1ms behind schedule)\n", late);
+    printf("time         %.3fs (recorded %.3fs)\n", elapsed, recorded);
+    printf("throughput   %.1f ops/s\n", elapsed > 0 ? issued / elapsed : 0);
+    if (issued > 0) {
+        printf("latency      p50 %.1fus  p99 %.1fus  p999 %.1fus  max %.1fus\n",
+            latency[issued / 2] / 1e3, latency[(long)(issued * 0.99)] / 1e3,
+            latency[(long)(issued * 0.999)] / 1e3, latency[issued - 1] / 1e3);
+    }
+
+    free(latency);
+    free(recs);
+    free(inum_map);
+    return mismatches == 0 ? 0 : 1;
+}
@@ -1,42 +1,169 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <signal.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <time.h>
 #include "ufs.h"
 #include "udp.h"
 #include "mfs.h"
+#include "fsck.h"
+#include "metrics.h"
+#include "trace.h"
+#include "uring.h"
+#include "shm.h"
+#include "repl.h"
 
 
 typedef struct {
     unsigned int bits[UFS_BLOCK_SIZE / sizeof(unsigned int)];
 } bitmap_t;
 
+// dir_slots of them, as many as fit in a block
 typedef struct {
-    dir_ent_t entries[128];
+    dir_ent_t entries[0];
 } dir_block_t;
 
-int sd;
-struct sockaddr_in sockaddr;
+// one event loop per socket. with -n > 1 the sockets share the port
+// through SO_REUSEPORT, the kernel spreads clients across them and
+// every loop works on the same mapped image.
+typedef struct {
+    int id;
+    int sd;
+    char **blocks;
+    metrics_t metrics;
+} loop_t;
+
+loop_t *loops;
+int nloops = 1;
+int use_uring;
+
+// clients that get a thread of their own: same-host clients on the shm
+// transport (-l) and stream connections (-T, -U)
+typedef struct conn {
+    struct conn *next;
+    int fd;
+    shm_chan_t *chan; // NULL for a stream
+    metrics_t metrics;
+} conn_t;
+
+// replication: a primary ships mutations to the backups in -b; a
+// backup (-B) takes mutations only from a primary's link
+char *backup_list;
+int backup_mode;
+__thread int replicating; // this thread serves a primary's link
+// a backup serves reads only while its primary's link is up: once the
+// primary drops it, it no longer gets the mutations clients are acked for
+int primary_linked;
+
+char *shm_path;
+char *unix_path;
+conn_t *conns;
+metrics_t conns_retired; // counts of connections that have gone
+pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// state of the loop running on this thread
+__thread int sd;
+__thread struct sockaddr_in sockaddr;
+__thread metrics_t *metrics;
+__thread int needs_flush;
+// set by a loop that can't block until backups ack (serve_uring): dispatch
+// then leaves the lsn the reply must wait for in awaiting_lsn
+__thread int defer_acks;
+__thread unsigned long long awaiting_lsn;
+
+// writes, creats and unlinks take this, one at a time. lookups, stats
+// and reads take no lock at all: every inode has a sequence number that
+// is odd while a writer is changing the inode, its data or (for a
+// directory) its entries. readers copy what they need into the response
+// and start over if the number moved underneath them.
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned int *inode_seq;
+
+// UDP clients retransmit when a reply is lost. appends, renames and
+// range copies (which can overlap within a file) must not be applied
+// twice, so the last reply of that kind to each client is kept and sent
+// again. a client has one call outstanding at a time, so one slot per
+// client (address and port) is enough; clients that hash to the same
+// slot can push each other out.
+#define DUP_SLOTS 4096
+// a request up to this many seqs older than the remembered one is a
+// stale duplicate the client has stopped waiting for
+#define DUP_WINDOW 1024
+
+typedef struct {
+    unsigned int addr;
+    unsigned short port;
+    message_t reply; // head only
+    unsigned long long lsn; // its awaiting_lsn
+} dup_t;
+
+dup_t *dups;
+pthread_mutex_t dups_lock = PTHREAD_MUTEX_INITIALIZER;
 
+int image_fd;
 void *image;
 int image_size;
+// the mapping covers the image at the largest the data bitmap allows,
+// so growing it (handle_grow) never moves anything that points into it
+long map_size;
+int max_data;
+
+// unlinks and truncates put the blocks they free on the pending list;
+// the reclaimer clears them from the data bitmap every RECLAIM_MS, at
+// most RECLAIM_BATCH runs per hold of fs_lock
+#define RECLAIM_MS 100
+#define RECLAIM_BATCH 64
+// reclaimed blocks are punched out of the image file, until the file
+// system it's on turns out not to support that
+int punch_holes = 1;
+// runs reclaim() took during the mutation in progress (under fs_lock):
+// a mutation can reclaim (free_blocks) and still fail
+int reclaimed_runs;
 
 // super block
 super_t *s;
+// the image's block size, and the entries that fit in a directory's block
+int block_size;
+int dir_slots;
 // pointers
 bitmap_t *inode_bitmap;
 bitmap_t *data_bitmap;
 inode_t *itable;
+ufs_pending_t *pending;
+
+unsigned long long start_ns;
+
+// periodic stats dump, off unless -s is given
+char *stats_path;
+int stats_interval = 10;
+
+// request trace, off unless -t is given. loops check trace before
+// building a record; trace_lock keeps shutdown from closing it under
+// one being written
+FILE *trace;
+unsigned long long trace_start;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void intHandler(int dummy) {
     UDP_Close(sd);
-    exit(130);
+    if (shm_path != NULL) {
+        unlink(shm_path);
+    }
+    if (unix_path != NULL) {
+        unlink(unix_path);
+    }
+    exit(128 + dummy);
 }
 
 unsigned int get_bit(unsigned int *bitmap, int position) {
@@ -65,372 +192,676 @@ int get_free_bit(unsigned int *bitmap, int end) {
     return -1;
 }
 
-// UDP response
-int err() {
-    message_t response;
-    response.rc = -1;
-    int rc = UDP_Write(sd, &sockaddr, (char *) &response, sizeof(message_t));
-    if (rc < 0) {
-	    printf("server:: failed to send\n");
-        return -1;
+// seqlock on one inode. out of range inodes have nothing to protect,
+// the handler rejects them anyway
+unsigned int read_begin(int inum) {
+    if (inum < 0 || inum >= s->num_inodes) {
+        return 0;
     }
-    return 0;
+    unsigned int seq;
+    while ((seq = __atomic_load_n(&inode_seq[inum], __ATOMIC_ACQUIRE)) & 1) {
+        sched_yield();
+    }
+    return seq;
+}
+
+int read_retry(int inum, unsigned int seq) {
+    if (inum < 0 || inum >= s->num_inodes) {
+        return 0;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&inode_seq[inum], __ATOMIC_RELAXED) != seq;
+}
+
+// only called with fs_lock held, so writers never race each other here
+void write_begin(int inum) {
+    if (inum < 0 || inum >= s->num_inodes) {
+        return;
+    }
+    __atomic_store_n(&inode_seq[inum], inode_seq[inum] + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void write_end(int inum) {
+    if (inum < 0 || inum >= s->num_inodes) {
+        return;
+    }
+    __atomic_store_n(&inode_seq[inum], inode_seq[inum] + 1, __ATOMIC_RELEASE);
+}
+
+// a reader can see a pointer a writer is halfway through changing; check
+// it points into the data region before following it
+int valid_data_addr(int addr) {
+    int index = addr - s->data_region_addr;
+    return index >= 0 && index < s->num_data && get_bit(data_bitmap->bits, index) == 1;
+}
+
+// handlers fill in the response; the loop sends it
+void err(message_t *response) {
+    response->rc = -1;
 }
 
-int reply_success(message_t *response) {
+void reply_success(message_t *response) {
     response->rc = 0;
+}
 
-    int rc = UDP_Write(sd, &sockaddr, (char *) response, sizeof(message_t));
-    if (rc < 0) {
-	    printf("server:: failed to send\n");
-        return -1;
+unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// force write to disk before the reply goes out. the loop does the
+// msync once a write has dropped fs_lock, so other loops aren't held up
+// by the flush.
+void flush() {
+    needs_flush = 1;
+}
+
+int count_free(unsigned int *bitmap, int end) {
+    int used = 0;
+    for (int i = 0; i < end / 32; i++) {
+        used += __builtin_popcount(bitmap[i]);
     }
-    return 0;
+    for (int i = end / 32 * 32; i < end; i++) {
+        used += get_bit(bitmap, i);
+    }
+    return end - used;
+}
+
+// drop the contents of blocks nothing refers to any more, so the image
+// file takes up room only for live data and msync has nothing stale to
+// write back. they read as zeros afterwards
+void discard(int addr, int len) {
+    if (punch_holes && fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        (off_t)addr * block_size, (off_t)len * block_size) < 0) {
+        perror("server:: can't punch holes in the image");
+        punch_holes = 0;
+    }
+}
+
+int by_start(const void *a, const void *b) {
+    return ((ufs_run_t*)a)->start - ((ufs_run_t*)b)->start;
+}
+
+// give the blocks of up to n pending runs back, newest first. they are
+// discarded in address order, runs that meet as one
+void reclaim(int n) {
+    ufs_run_t batch[UFS_PENDING_RUNS];
+    int count = 0;
+    while (n-- > 0 && pending->num_runs > 0) {
+        ufs_run_t *run = &pending->runs[--pending->num_runs];
+        reclaimed_runs++;
+        int index = run->start - s->data_region_addr;
+        if (index < 0 || run->len < 0 || index + run->len > s->num_data) {
+            continue; // not a run of ours
+        }
+        for (int b = 0; b < run->len; b++) {
+            set_bit(data_bitmap->bits, index + b, 0);
+        }
+        batch[count++] = *run;
+    }
+
+    qsort(batch, count, sizeof(ufs_run_t), by_start);
+    for (int i = 0; i < count;) {
+        int start = batch[i].start;
+        int end = start + batch[i].len;
+        for (i++; i < count && batch[i].start <= end; i++) {
+            if (batch[i].start + batch[i].len > end) {
+                end = batch[i].start + batch[i].len;
+            }
+        }
+        discard(start, end - start);
+    }
+}
+
+// start queueing a file's blocks on the pending list; returns where its
+// runs begin
+int pend_begin() {
+    if (pending->num_runs + DIRECT_PTRS > UFS_PENDING_RUNS) {
+        // might not fit; catch up first
+        reclaim(pending->num_runs);
+    }
+    return pending->num_runs;
+}
+
+// queue addr, growing the file's last run when it's the next block
+void pend_block(int first, int addr) {
+    ufs_run_t *run = &pending->runs[pending->num_runs - 1];
+    if (pending->num_runs > first && run->start + run->len == addr) {
+        run->len++;
+        return;
+    }
+    run = &pending->runs[pending->num_runs++];
+    run->start = addr;
+    run->len = 1;
+}
+
+// free data blocks, for an allocation of need: pending blocks are
+// reclaimed on the spot if that's what it takes
+int free_blocks(int need) {
+    int n = count_free(data_bitmap->bits, s->num_data);
+    if (n < need && pending->num_runs > 0) {
+        reclaim(pending->num_runs);
+        n = count_free(data_bitmap->bits, s->num_data);
+    }
+    return n;
+}
+
+void collect_stats(MFS_Stats_t *stats) {
+    // other loops keep counting while this reads; close enough for stats
+    metrics_t *total = calloc(1, sizeof(metrics_t));
+    assert(total != NULL);
+    for (int i = 0; i < nloops; i++) {
+        metrics_merge(total, &loops[i].metrics);
+    }
+    pthread_mutex_lock(&conns_lock);
+    metrics_merge(total, &conns_retired);
+    for (conn_t *c = conns; c != NULL; c = c->next) {
+        metrics_merge(total, &c->metrics);
+    }
+    pthread_mutex_unlock(&conns_lock);
+    memset(stats, 0, sizeof(MFS_Stats_t));
+    metrics_summarize(total, stats);
+    free(total);
+    stats->uptime_ms = (now_ns() - start_ns) / 1000000;
+    stats->num_inodes = s->num_inodes;
+    stats->free_inodes = count_free(inode_bitmap->bits, s->num_inodes);
+    stats->num_data = s->num_data;
+    stats->free_data = count_free(data_bitmap->bits, s->num_data);
+    stats->block_size = block_size;
+    for (int i = 0; i < pending->num_runs; i++) {
+        stats->free_data += pending->runs[i].len;
+    }
+}
+
+void handle_stats(message_t *response) {
+    MFS_Stats_t stats;
+    collect_stats(&stats);
+    memcpy(response->buffer, &stats, sizeof(MFS_Stats_t));
+    reply_success(response);
 }
 
-void handle_lookup(int pinum, char *name, char *blocks[]) {
+void handle_lookup(int pinum, char *name, char *blocks[], message_t *response) {
     // if pinum not valid, reply -1
     if (pinum < 0 || pinum >= s->num_inodes) {
-        err();
+        err(response);
         return;
     }
     if (get_bit(inode_bitmap->bits, pinum) != 1) {
-        err();
+        err(response);
         return;
     }
 
     // if parent is not a dir, reply -1
     if (itable[pinum].type != UFS_DIRECTORY) {
-        err();
+        err(response);
         return;
     }
 
     int dir_size = itable[pinum].size;
     // if it's an empty dir, reply -1
     if (dir_size < sizeof(dir_ent_t)) {
-        err();
+        err(response);
         return;
     }
 
     int data_block_addr = (int)itable[pinum].direct[0];
-    if (data_block_addr == -1) {
-        err();
-        return;
-    }
-
-    int data_block_index = data_block_addr - s->data_region_addr;
     // if data block not valid, reply -1
-    if (get_bit(data_bitmap->bits, data_block_index) != 1) {
-        err();
+    if (!valid_data_addr(data_block_addr)) {
+        err(response);
         return;
     }
 
     dir_block_t *dir = (dir_block_t*)blocks[data_block_addr];
 
-    for (int i = 0; i < 128; i++) {
+    for (int i = 0; i < dir_slots; i++) {
         if (dir->entries[i].inum == -1) {
             continue;
         }
-        if (strcmp(dir->entries[i].name, name) == 0) {
-            // file/dir found, reply inum
-            message_t response;
-            response.inum = dir->entries[i].inum;
-            reply_success(&response);
+        // an entry being written may not be terminated yet
+        if (strncmp(dir->entries[i].name, name, sizeof(dir->entries[i].name)) == 0) {
+            // file/dir found, reply inum, and what MFS_Stat would say
+            // about it so callers needn't ask
+            int inum = dir->entries[i].inum;
+            response->inum = inum;
+            if (inum < 0 || inum >= s->num_inodes) {
+                err(response);
+                return;
+            }
+            unsigned int seq;
+            do {
+                seq = read_begin(inum);
+                response->type = UFS_TYPE(itable[inum].type);
+                response->size = itable[inum].size;
+            } while (read_retry(inum, seq));
+            reply_success(response);
             return;
         }
     }
     // find/dir not found, reply -1;
-    err();
+    err(response);
 }
 
-void handle_stat(int inum, char *blocks[]) {
+void handle_stat(int inum, char *blocks[], message_t *response) {
     // if inum not valid, reply -1
     if (inum < 0 || inum >= s->num_inodes) {
-        err();
+        err(response);
         return;
     }
     if (get_bit(inode_bitmap->bits, inum) != 1) {
-        err();
+        err(response);
         return;
     }
     // reply MFS_Stat
-    message_t response;
-    response.type = itable[inum].type;
-    response.size = itable[inum].size;
-    reply_success(&response);
+    response->type = UFS_TYPE(itable[inum].type);
+    response->size = itable[inum].size;
+    reply_success(response);
 }
 
-void handle_read(int inum, int offset, int nbytes, char *blocks[]) {
+void handle_read(int inum, int offset, int nbytes, char *blocks[], message_t *response) {
     // if inum not valid, reply -1
     if (inum < 0 || inum >= s->num_inodes) {
-        err();
+        err(response);
         return;
     }
     if (get_bit(inode_bitmap->bits, inum) != 1) {
-        err();
-        return;
-    }
-
-    // if not a file, reply -1
-    if (itable[inum].type != UFS_REGULAR_FILE) {
-        err();
-        return;
-    }
-
-    int size = itable[inum].size;
-
-    // check offset
-    if (offset < 0 || offset + nbytes > size) {
-        err();
+        err(response);
         return;
     }
 
-    // get the target block(s)
-    int first_block = offset / UFS_BLOCK_SIZE;
-    int block_offset = offset % UFS_BLOCK_SIZE;
-    int bytes_left = 0;
-    int block_num = 1;
-
-    if (block_offset + nbytes > UFS_BLOCK_SIZE) {
-        block_num++;
-        bytes_left = nbytes - UFS_BLOCK_SIZE + block_offset;
+    // read each once: a truncate can turn the file inline in between,
+    // and the seqlock retry only comes after the copy
+    int type = __atomic_load_n(&itable[inum].type, __ATOMIC_RELAXED);
+    int size = __atomic_load_n(&itable[inum].size, __ATOMIC_RELAXED);
+    if (type == UFS_DIRECTORY) {
+        // its entries: the whole block, since free slots don't count
+        // towards the size
+        size = block_size;
     }
+    int limit = type & UFS_INLINE ? UFS_INLINE_MAX : DIRECT_PTRS * block_size;
 
-    // get the first block
-    int data_block_addr1 = (int)itable[inum].direct[first_block];
-    if (data_block_addr1 == -1) {
-        err();
+    // check offset; dispatch has checked nbytes against the transport.
+    // subtract rather than add: offset + nbytes can overflow an int
+    if (offset < 0 || nbytes < 0 || offset > size - nbytes || offset > limit - nbytes) {
+        err(response);
         return;
     }
-    int data_block_idx1 = data_block_addr1 - s->data_region_addr;
-    // if data block not valid, reply -1
-    if (get_bit(data_bitmap->bits, data_block_idx1) != 1) {
-        err();
+    // checked above, so every block below is within direct[]
+    int end = offset + nbytes;
+    // a sharded client rewrites the inums in a directory's entries
+    response->type = UFS_TYPE(type);
+
+    if (type & UFS_INLINE) {
+        memcpy(response->buffer, (char*)itable[inum].direct + offset, nbytes);
+        reply_success(response);
         return;
     }
 
-    // read data
-    char *data_start = blocks[data_block_addr1] + block_offset;
-    if (block_num == 1) {
-        message_t response;
-        memcpy(response.buffer, data_start, nbytes);
-        reply_success(&response);
-        return;
-    } else {
-        // get the second block
-        int data_block_addr2 = (int)itable[inum].direct[first_block + 1];
-        if (data_block_addr2 == -1) {
-            err();
-            return;
+    // copy block by block
+    for (int done = 0; done < nbytes; ) {
+        int pos = offset + done;
+        int block = pos / block_size;
+        int block_offset = pos % block_size;
+        int count = block_size - block_offset;
+        if (count > end - pos) {
+            count = end - pos;
+        }
+        int data_block_addr = (int)itable[inum].direct[block];
+        if (data_block_addr == -1) {
+            // a hole
+            memset(response->buffer + done, 0, count);
+            done += count;
+            continue;
         }
-        int data_block_idx2 = data_block_addr2 - s->data_region_addr;
         // if data block not valid, reply -1
-        if (get_bit(data_bitmap->bits, data_block_idx2) != 1) {
-            err();
+        if (!valid_data_addr(data_block_addr)) {
+            err(response);
             return;
         }
-        message_t response;
-        memcpy(response.buffer, data_start, nbytes - bytes_left);
-        memcpy(response.buffer + nbytes - bytes_left, blocks[data_block_addr2], bytes_left);
-        reply_success(&response);
-        return;
+        memcpy(response->buffer + done, blocks[data_block_addr] + block_offset, count);
+        done += count;
+    }
+    reply_success(response);
+}
+
+// move an inline file's contents out to a data block. fails, changing
+// nothing, unless need blocks (counting that one) are free
+int uninline(int inum, int need, char *blocks[]) {
+    int size = itable[inum].size;
+    if (free_blocks(need) < need) {
+        return -1;
+    }
+    int block_index = -1;
+    if (size > 0) {
+        block_index = get_free_bit(data_bitmap->bits, s->num_data);
+        set_bit(data_bitmap->bits, block_index, 1);
+        memset(blocks[block_index + s->data_region_addr] + size, 0, block_size - size);
+        memcpy(blocks[block_index + s->data_region_addr], itable[inum].direct, size);
+    }
+    for (int b = 0; b < DIRECT_PTRS; b++) {
+        itable[inum].direct[b] = -1;
+    }
+    if (block_index != -1) {
+        itable[inum].direct[0] = block_index + s->data_region_addr;
     }
+    itable[inum].type = UFS_REGULAR_FILE;
+    return 0;
+}
+
+// inums packed in buffer; replies with an MFS_Stat_t for each, type -1
+// for those that aren't allocated
+void handle_stat_many(int *inums, int n, message_t *response) {
+    MFS_Stat_t *stats = (MFS_Stat_t*)response->buffer;
+    for (int i = 0; i < n; i++) {
+        int inum = inums[i];
+        if (inum < 0 || inum >= s->num_inodes) {
+            stats[i].type = -1;
+            stats[i].size = 0;
+            continue;
+        }
+        unsigned int seq;
+        do {
+            seq = read_begin(inum);
+            if (get_bit(inode_bitmap->bits, inum) == 1) {
+                stats[i].type = UFS_TYPE(itable[inum].type);
+                stats[i].size = itable[inum].size;
+            } else {
+                stats[i].type = -1;
+                stats[i].size = 0;
+            }
+        } while (read_retry(inum, seq));
+    }
+    response->nbytes = n * sizeof(MFS_Stat_t);
+    reply_success(response);
 }
 
-void handle_write(int inum, char *buffer, int offset, int nbytes, char *blocks[]) {
+void handle_write(int inum, char *buffer, int offset, int nbytes, char *blocks[], message_t *response) {
     // if inum not valid, reply -1
     if (inum < 0 || inum >= s->num_inodes) {
-        err();
+        err(response);
         return;
     }
     if (get_bit(inode_bitmap->bits, inum) != 1) {
-        err();
+        err(response);
         return;
     }
 
     // if not a file, reply -1
-    if (itable[inum].type != UFS_REGULAR_FILE) {
-        err();
+    if (UFS_TYPE(itable[inum].type) != UFS_REGULAR_FILE) {
+        err(response);
         return;
     }
 
     int size = itable[inum].size;
 
-    // check offset
-    if (offset < 0 || offset > size) {
-        err();
+    // check offset. writing past the end leaves a hole, which reads as
+    // zeros and takes no blocks
+    if (offset < 0 || nbytes < 0) {
+        err(response);
         return;
     }
-
-    // get the target block(s)
-    int first_block = offset / UFS_BLOCK_SIZE;
-    int block_offset = offset % UFS_BLOCK_SIZE;
-    int bytes_left = 0;
-    int block_num = 1;
-
-    if (block_offset + nbytes > UFS_BLOCK_SIZE) {
-        block_num++;
-        bytes_left = nbytes - UFS_BLOCK_SIZE + block_offset;
-    }
-
-    if (first_block >= DIRECT_PTRS) {
-        // not that much blocks
-        err();
+    if ((long)offset + nbytes > (long)DIRECT_PTRS * block_size) {
+        // not that much blocks. in long: the sum can overflow an int
+        err(response);
         return;
     }
 
-    // get the first block
-    int data_block_addr1 = (int)itable[inum].direct[first_block];
-    int data_block_idx1 = data_block_addr1 - s->data_region_addr;
-
-    if (data_block_addr1 == -1) {
-        // create and write in a new block
-        int new_block_index = -1;
-
-        new_block_index = get_free_bit(data_bitmap->bits, s->num_data);
-        if (new_block_index == -1) {
+    if (itable[inum].type & UFS_INLINE) {
+        if (offset + nbytes <= UFS_INLINE_MAX) {
+            if (offset > size) {
+                memset((char*)itable[inum].direct + size, 0, offset - size);
+            }
+            memcpy((char*)itable[inum].direct + offset, buffer, nbytes);
+            if (offset + nbytes > size) {
+                itable[inum].size = offset + nbytes;
+            }
+            flush();
+            reply_success(response);
+            return;
+        }
+        // outgrown the inode: move what's there to a block of its own
+        // and carry on as for any other file
+        int need = (offset + nbytes - 1) / block_size - offset / block_size + 1;
+        if (size > 0 && offset >= block_size) {
+            need++;
+        }
+        if (uninline(inum, need, blocks) < 0) {
             // no empty data block
-            err();
+            err(response);
             return;
         }
-        set_bit(data_bitmap->bits, new_block_index, 1);
-        data_block_addr1 = new_block_index + s->data_region_addr;
-        data_block_idx1 = new_block_index;
+    }
 
-        itable[inum].direct[first_block] = data_block_addr1;
-    } else {
-        // if data block not valid, reply -1
-        if (get_bit(data_bitmap->bits, data_block_idx1) != 1) {
-            err();
+    // check the blocks already there and count the ones to allocate, so
+    // a write that can't fit fails before it changes anything
+    int first_block = offset / block_size;
+    int last_block = nbytes > 0 ? (offset + nbytes - 1) / block_size : first_block - 1;
+    int missing = 0;
+    for (int b = first_block; b <= last_block; b++) {
+        int data_block_addr = (int)itable[inum].direct[b];
+        if (data_block_addr == -1) {
+            missing++;
+        } else if (get_bit(data_bitmap->bits, data_block_addr - s->data_region_addr) != 1) {
+            // if data block not valid, reply -1
+            err(response);
             return;
         }
     }
+    if (missing > 0 && free_blocks(missing) < missing) {
+        // no empty data block
+        err(response);
+        return;
+    }
 
-    // write data
-    char *data_start = blocks[data_block_addr1] + block_offset;
-    if (block_num == 1) {
-        memcpy(data_start, buffer, nbytes);
+    // the last block may hold stale bytes past the old end; they become
+    // part of the file now, so clear them
+    int tail = size % block_size;
+    if (offset > size && tail > 0 && (int)itable[inum].direct[size / block_size] != -1) {
+        int end = offset / block_size == size / block_size ? offset % block_size : block_size;
+        memset(blocks[itable[inum].direct[size / block_size]] + tail, 0, end - tail);
+    }
 
-        // update size
-        int new_size = size;
-        if (offset + nbytes > size) {
-            new_size = offset + nbytes;
+    // write data
+    for (int done = 0; done < nbytes; ) {
+        int block = (offset + done) / block_size;
+        int block_offset = (offset + done) % block_size;
+        int count = block_size - block_offset;
+        if (count > nbytes - done) {
+            count = nbytes - done;
+        }
+        int data_block_addr = (int)itable[inum].direct[block];
+        if (data_block_addr == -1) {
+            // create and write in a new block
+            int new_block_index = get_free_bit(data_bitmap->bits, s->num_data);
+            set_bit(data_bitmap->bits, new_block_index, 1);
+            data_block_addr = new_block_index + s->data_region_addr;
+            itable[inum].direct[block] = data_block_addr;
+            if (count < block_size) {
+                // whatever a freed block held before must read as zeros
+                memset(blocks[data_block_addr], 0, block_size);
+            }
         }
-        itable[inum].size = new_size;
+        memcpy(blocks[data_block_addr] + block_offset, buffer + done, count);
+        done += count;
+    }
 
-        // force write to disk
-        msync(image, image_size, MS_SYNC);
+    // update size
+    if (offset + nbytes > size) {
+        itable[inum].size = offset + nbytes;
+    }
 
-        message_t response;
-        reply_success(&response);
+    // force write to disk
+    flush();
+
+    reply_success(response);
+}
+
+void handle_append(int inum, char *buffer, int nbytes, char *blocks[], message_t *response) {
+    if (inum < 0 || inum >= s->num_inodes) {
+        err(response);
         return;
-    } else {
-        if (first_block + 1 >= DIRECT_PTRS) {
-            // not that much blocks
-            err();
-            return;
-        }
-        // get the second block
-        int data_block_addr2 = (int)itable[inum].direct[first_block + 1];
-        int data_block_idx2 = data_block_addr2 - s->data_region_addr;
+    }
+    // writes are serialized, so the end can't move before this one lands
+    int offset = itable[inum].size;
+    handle_write(inum, buffer, offset, nbytes, blocks, response);
+    response->offset = offset;
+}
 
-        if (data_block_addr2 == -1) {
-            // create and write in a new block
-            int new_block_index = -1;
+void handle_truncate(int inum, int size, char *blocks[], message_t *response) {
+    // if inum not valid, reply -1
+    if (inum < 0 || inum >= s->num_inodes) {
+        err(response);
+        return;
+    }
+    if (get_bit(inode_bitmap->bits, inum) != 1) {
+        err(response);
+        return;
+    }
+
+    // if not a file, reply -1
+    if (UFS_TYPE(itable[inum].type) != UFS_REGULAR_FILE) {
+        err(response);
+        return;
+    }
+    if (size < 0 || size > DIRECT_PTRS * block_size) {
+        err(response);
+        return;
+    }
+
+    inode_t *inode = &itable[inum];
+    int old_size = inode->size;
+
+    if (!(inode->type & UFS_INLINE) && size <= UFS_INLINE_MAX) {
+        // small enough to go back in the inode
+        char head[UFS_INLINE_MAX];
+        memset(head, 0, sizeof(head));
+        int first = (int)inode->direct[0];
+        if (first != -1 && valid_data_addr(first)) {
+            memcpy(head, blocks[first], size < old_size ? size : old_size);
+        }
+        int runs = pend_begin();
+        for (int b = 0; b < DIRECT_PTRS; b++) {
+            int addr = (int)inode->direct[b];
+            if (addr != -1 && valid_data_addr(addr)) {
+                pend_block(runs, addr);
+            }
+        }
+        memcpy(inode->direct, head, sizeof(head));
+        inode->type = UFS_REGULAR_FILE | UFS_INLINE;
+        old_size = size;
+    }
 
-            new_block_index = get_free_bit(data_bitmap->bits, s->num_data);
-            if (new_block_index == -1) {
-                // no empty data block
-                err();
+    if (inode->type & UFS_INLINE) {
+        if (size > UFS_INLINE_MAX) {
+            // the rest is a hole, only what's there now needs a block
+            if (uninline(inum, old_size > 0, blocks) < 0) {
+                err(response);
                 return;
             }
-            set_bit(data_bitmap->bits, new_block_index, 1);
-            data_block_addr2 = new_block_index + s->data_region_addr;
-            data_block_idx2 = new_block_index;
-        
-            itable[inum].direct[first_block + 1] = data_block_addr2;
         } else {
-            // if data block not valid, reply -1
-            if (get_bit(data_bitmap->bits, data_block_idx2) != 1) {
-                err();
-                return;
+            // keep the bytes past the end zero, writes past it rely on that
+            if (size < old_size) {
+                memset((char*)inode->direct + size, 0, old_size - size);
             }
+            inode->size = size;
+            flush();
+            reply_success(response);
+            return;
         }
+    }
 
-        memcpy(data_start, buffer, nbytes - bytes_left);
-        memcpy(blocks[data_block_addr2], buffer + nbytes - bytes_left, bytes_left);
+    // drop every block wholly past the new end in one pass
+    int keep = (size + block_size - 1) / block_size;
+    int runs = pend_begin();
+    for (int b = keep; b < DIRECT_PTRS; b++) {
+        int addr = (int)inode->direct[b];
+        if (addr == -1) {
+            continue;
+        }
+        if (valid_data_addr(addr)) {
+            pend_block(runs, addr);
+        }
+        inode->direct[b] = -1;
+    }
 
-        // update size
-        int new_size = size;
-        if (offset + nbytes > size) {
-            new_size = offset + nbytes;
+    // what's left of the block the file now ends in (or, growing, used
+    // to end in) must read as zeros
+    int end = size < old_size ? size : old_size;
+    if (end % block_size != 0) {
+        int addr = (int)inode->direct[end / block_size];
+        if (addr != -1 && valid_data_addr(addr)) {
+            memset(blocks[addr] + end % block_size, 0, block_size - end % block_size);
         }
-        itable[inum].size = new_size;
+    }
 
-        // force write to disk
-        msync(image, image_size, MS_SYNC);
+    inode->size = size;
 
-        message_t response;
-        reply_success(&response);
-        return;
-    }
-    err();
+    // force write to disk
+    flush();
+
+    reply_success(response);
 }
 
-void handle_creat(int pinum, int type, char *name, char *blocks[]) {
+void handle_creat(int pinum, int type, char *name, char *blocks[], message_t *response) {
     // if pinum not valid, reply -1
     if (pinum < 0 || pinum >= s->num_inodes) {
-        err();
+        err(response);
         return;
     }
     if (get_bit(inode_bitmap->bits, pinum) != 1) {
-        err();
+        err(response);
         return;
     }
 
     // if parent is not a dir, reply -1
     if (itable[pinum].type != UFS_DIRECTORY) {
-        err();
+        err(response);
         return;
     }
 
     int dir_size = itable[pinum].size;
     // if it's an empty dir, reply -1
     if (dir_size < sizeof(dir_ent_t)) {
-        err();
+        err(response);
         return;
     }
 
     int data_block_addr = (int)itable[pinum].direct[0];
     if (data_block_addr == -1) {
-        err();
+        err(response);
         return;
     }
     int data_block_index = data_block_addr - s->data_region_addr;
     // if data block not valid, reply -1
     if (get_bit(data_bitmap->bits, data_block_index) != 1) {
-        err();
+        err(response);
         return;
     }
 
     dir_block_t *dir = (dir_block_t*)blocks[data_block_addr];
 
-    for (int i = 0; i < 128; i++) {
+    for (int i = 0; i < dir_slots; i++) {
         if (dir->entries[i].inum == -1) {
             continue;
         }
         if (strcmp(dir->entries[i].name, name) == 0) {
-            if (itable[dir->entries[i].inum].type == type) {
+            if (UFS_TYPE(itable[dir->entries[i].inum].type) == type) {
                 // file/dir found, reply success
-                message_t response;
-                reply_success(&response);
+                reply_success(response);
                 return;
             }
         }
     }
 
+    if (type == UFS_DIRECTORY && free_blocks(1) < 1) {
+        // no empty data block for its entries
+        err(response);
+        return;
+    }
+
     // create a file
-    for (int i = 0; i < 128; i++) {
+    for (int i = 0; i < dir_slots; i++) {
         if (dir->entries[i].inum != -1) {
             continue;
         }
@@ -440,9 +871,10 @@ void handle_creat(int pinum, int type, char *name, char *blocks[]) {
 
         if (inum == -1) {
             // no empty inode
-            err();
+            err(response);
             return;
         }
+        write_begin(inum);
         set_bit(inode_bitmap->bits, inum, 1);
 
         dir->entries[i].inum = inum;
@@ -454,13 +886,16 @@ void handle_creat(int pinum, int type, char *name, char *blocks[]) {
         }
 
         if (type == UFS_REGULAR_FILE) {
+            // new files start out inline, with nothing in direct[]
+            itable[inum].type = UFS_REGULAR_FILE | UFS_INLINE;
+            memset(itable[inum].direct, 0, sizeof(itable[inum].direct));
             itable[inum].size = 0;
         } else if (type == UFS_DIRECTORY) {
             // write out new dir contents to new data block
             int dir_index = get_free_bit(data_bitmap->bits, s->num_data);
             if (dir_index == -1) {
                 // no empty datablock
-                err();
+                err(response);
             }
             int dir_addr = dir_index + s->data_region_addr;
 
@@ -473,123 +908,1637 @@ void handle_creat(int pinum, int type, char *name, char *blocks[]) {
             strcpy(new_dir->entries[1].name, "..");
             new_dir->entries[1].inum = pinum;
 
-            for (i = 2; i < 128; i++)
+            for (i = 2; i < dir_slots; i++)
             new_dir->entries[i].inum = -1;
 
             itable[inum].size = 2 * sizeof(dir_ent_t);
             itable[inum].direct[0] = dir_addr;
         }
         itable[pinum].size += sizeof(dir_ent_t);
+        write_end(inum);
 
         // force write to disk
-        msync(image, image_size, MS_SYNC);
+        flush();
 
-        message_t response;
-        reply_success(&response);
+        reply_success(response);
         return;
     }
     // dir is full, reply -1;
-    err();
+    err(response);
 }
 
-void handle_unlink(int pinum, char *name, char *blocks[]) {
-    // if pinum not valid, reply -1
-    if (pinum < 0 || pinum >= s->num_inodes) {
-        err();
-        return;
+// give back an inode. its blocks go on the pending list for the
+// reclaimer to free later
+void release_inode(int inum) {
+    // go by the pointers, not the size: a directory's size counts
+    // entries, not blocks
+    int first = pend_begin();
+    for (int j = 0; j < DIRECT_PTRS && !(itable[inum].type & UFS_INLINE); j++) {
+        int file_addr = (int)itable[inum].direct[j];
+        if (file_addr != -1) {
+            pend_block(first, file_addr);
+        }
     }
-    if (get_bit(inode_bitmap->bits, pinum) != 1) {
-        err();
-        return;
+
+    // clear file inode bitmap
+    set_bit(inode_bitmap->bits, inum, 0);
+}
+
+// the entries of directory pinum, or NULL if it isn't one
+dir_block_t *dir_block(int pinum, char *blocks[]) {
+    if (pinum < 0 || pinum >= s->num_inodes || get_bit(inode_bitmap->bits, pinum) != 1) {
+        return NULL;
+    }
+    if (itable[pinum].type != UFS_DIRECTORY || !valid_data_addr((int)itable[pinum].direct[0])) {
+        return NULL;
     }
+    return (dir_block_t*)blocks[itable[pinum].direct[0]];
+}
 
-    // if not a dir, reply -1
-    if (itable[pinum].type != UFS_DIRECTORY) {
-        err();
-        return;
+// slot of name in dir, or -1
+int find_entry(dir_block_t *dir, char *name) {
+    for (int i = 0; i < dir_slots; i++) {
+        if (dir->entries[i].inum != -1 && strcmp(dir->entries[i].name, name) == 0) {
+            return i;
+        }
     }
+    return -1;
+}
 
-    int data_block_addr = (int)itable[pinum].direct[0];
-    if (data_block_addr == -1) {
-        err();
+void handle_rename(int src_pinum, char *src_name, int dst_pinum, char *dst_name, char *blocks[], message_t *response) {
+    dir_block_t *src_dir = dir_block(src_pinum, blocks);
+    dir_block_t *dst_dir = dir_block(dst_pinum, blocks);
+    if (src_dir == NULL || dst_dir == NULL) {
+        err(response);
         return;
     }
-    int data_block_index = data_block_addr - s->data_region_addr;
-    // if data block not valid, reply -1
-    if (get_bit(data_bitmap->bits, data_block_index) != 1) {
-        err();
+    if (strcmp(src_name, ".") == 0 || strcmp(src_name, "..") == 0 ||
+        strcmp(dst_name, ".") == 0 || strcmp(dst_name, "..") == 0) {
+        err(response);
         return;
     }
 
-    dir_block_t *dir = (dir_block_t*)blocks[data_block_addr];
-
-    int dir_size = itable[pinum].size;
-    // if it's an empty dir, reply success
-    if (dir_size < sizeof(dir_ent_t)) {
-        message_t response;
-        reply_success(&response);
+    int src_slot = find_entry(src_dir, src_name);
+    if (src_slot == -1) {
+        err(response);
         return;
     }
-
-    for (int i = 0; i < 128; i++) {
-        if (dir->entries[i].inum == -1) {
-            continue;
+    int inum = src_dir->entries[src_slot].inum;
+    int type = UFS_TYPE(itable[inum].type);
+
+    int dst_slot = find_entry(dst_dir, dst_name);
+    int old_inum = dst_slot == -1 ? -1 : dst_dir->entries[dst_slot].inum;
+    if (old_inum == inum) {
+        // already there
+        reply_success(response);
+        return;
+    }
+    if (old_inum != -1) {
+        // replacing: a file only by a file, a directory only by a
+        // directory, and only an empty one
+        if (UFS_TYPE(itable[old_inum].type) != type) {
+            err(response);
+            return;
         }
-        if (strcmp(dir->entries[i].name, name) == 0) {
-            // file/dir found, unlink
-            int file_inum = dir->entries[i].inum;
-            int type = itable[file_inum].type;
-            int size = itable[file_inum].size;
-            if (type == UFS_DIRECTORY) {
-                if (size > 2 * sizeof(dir_ent_t)) {
-                    // dir not empty
-                    err();
-                    return;
-                }
-            }
-            int file_block_num = itable[file_inum].size / UFS_BLOCK_SIZE;
-            if (file_block_num % UFS_BLOCK_SIZE != 0) {
-                file_block_num++;
-            }
-
-            dir->entries[i].inum = -1;
-            itable[pinum].size -= sizeof(dir_ent_t);
-
-            // clear file data bitmap
-            for (int j = 0; j < file_block_num; j++) {
-                int file_addr = (int)itable[file_inum].direct[j];
-                int file_block_idx = file_addr - s->data_region_addr;
-                set_bit(data_bitmap->bits, file_block_idx, 0);
-            }
-
-            // clear file inode bitmap
-            set_bit(inode_bitmap->bits, file_inum, 0);
-
-            // force write to disk
-            msync(image, image_size, MS_SYNC);
-
-            message_t response;
-            reply_success(&response);
+        if (type == UFS_DIRECTORY && itable[old_inum].size > 2 * sizeof(dir_ent_t)) {
+            err(response);
+            return;
+        }
+    }
+    if (dst_slot == -1) {
+        for (dst_slot = 0; dst_slot < dir_slots && dst_dir->entries[dst_slot].inum != -1; dst_slot++) {
+        }
+        if (dst_slot == dir_slots) {
+            // dir is full
+            err(response);
+            return;
+        }
+    }
+
+    int dotdot = -1;
+    if (type == UFS_DIRECTORY && dst_pinum != src_pinum) {
+        // a directory can't move into itself or anything below it: walk
+        // up from the new parent to the root looking for it
+        for (int up = dst_pinum, depth = 0; up != 0; depth++) {
+            dir_block_t *d = dir_block(up, blocks);
+            int slot = d == NULL ? -1 : find_entry(d, "..");
+            if (up == inum || slot == -1 || depth == s->num_inodes) {
+                err(response);
+                return;
+            }
+            up = d->entries[slot].inum;
+        }
+        dir_block_t *moved = dir_block(inum, blocks);
+        dotdot = moved == NULL ? -1 : find_entry(moved, "..");
+        if (dotdot == -1) {
+            err(response);
+            return;
+        }
+    }
+
+    // src_pinum is bracketed by dispatch
+    if (dst_pinum != src_pinum) {
+        write_begin(dst_pinum);
+    }
+    write_begin(inum);
+    if (old_inum != -1) {
+        write_begin(old_inum);
+    }
+
+    if (old_inum == -1) {
+        strcpy(dst_dir->entries[dst_slot].name, dst_name);
+        itable[dst_pinum].size += sizeof(dir_ent_t);
+    } else {
+        release_inode(old_inum);
+    }
+    dst_dir->entries[dst_slot].inum = inum;
+    src_dir->entries[src_slot].inum = -1;
+    itable[src_pinum].size -= sizeof(dir_ent_t);
+    if (dotdot != -1) {
+        dir_block(inum, blocks)->entries[dotdot].inum = dst_pinum;
+    }
+
+    if (old_inum != -1) {
+        write_end(old_inum);
+    }
+    write_end(inum);
+    if (dst_pinum != src_pinum) {
+        write_end(dst_pinum);
+    }
+
+    // force write to disk
+    flush();
+
+    reply_success(response);
+}
+
+// names packed 28 bytes apiece in names. all of them are created, or
+// none; names that already exist with the same type count as created.
+// replies with the inum of each
+void handle_creat_many(int pinum, int type, char *names, int n, char *blocks[], message_t *response) {
+    dir_block_t *dir = dir_block(pinum, blocks);
+    if (dir == NULL || (type != UFS_REGULAR_FILE && type != UFS_DIRECTORY)) {
+        err(response);
+        return;
+    }
+
+    // sort out which exist, -1 for those to create and -2 - j for the
+    // same name as an earlier j. not in response->buffer: on shm the
+    // client can write that while this runs
+    int *inums = malloc((n + 1) * sizeof(int));
+    assert(inums != NULL);
+    int needed = 0;
+    for (int i = 0; i < n; i++) {
+        char *name = names + i * sizeof(dir->entries[0].name);
+        if (memchr(name, '\0', sizeof(dir->entries[0].name)) == NULL || name[0] == '\0' ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            free(inums);
+            err(response);
+            return;
+        }
+        int slot = find_entry(dir, name);
+        if (slot != -1) {
+            int inum = dir->entries[slot].inum;
+            if (inum < 0 || inum >= s->num_inodes || UFS_TYPE(itable[inum].type) != type) {
+                free(inums);
+                err(response);
+                return;
+            }
+            inums[i] = inum;
+            continue;
+        }
+        inums[i] = -1;
+        for (int j = 0; j < i; j++) {
+            if (inums[j] == -1 && strcmp(names + j * sizeof(dir->entries[0].name), name) == 0) {
+                inums[i] = -2 - j;
+                break;
+            }
+        }
+        needed += inums[i] == -1;
+    }
+
+    int free_slots = 0;
+    for (int i = 0; i < dir_slots; i++) {
+        free_slots += dir->entries[i].inum == -1;
+    }
+    if (needed > free_slots || needed > count_free(inode_bitmap->bits, s->num_inodes) ||
+        (type == UFS_DIRECTORY && needed > free_blocks(needed))) {
+        free(inums);
+        err(response);
+        return;
+    }
+
+    // one pass over each bitmap and the directory, picking up where the
+    // last entry left off
+    int next_inode = 0, next_block = 0, next_slot = 0;
+    for (int i = 0; i < n; i++) {
+        if (inums[i] != -1) {
+            continue;
+        }
+        while (get_bit(inode_bitmap->bits, next_inode) == 1) {
+            next_inode++;
+        }
+        while (dir->entries[next_slot].inum != -1) {
+            next_slot++;
+        }
+        int inum = next_inode++;
+        write_begin(inum);
+        set_bit(inode_bitmap->bits, inum, 1);
+        strcpy(dir->entries[next_slot].name, names + i * sizeof(dir->entries[0].name));
+        dir->entries[next_slot].inum = inum;
+
+        inode_t *inode = &itable[inum];
+        if (type == UFS_REGULAR_FILE) {
+            // new files start out inline, with nothing in direct[]
+            inode->type = UFS_REGULAR_FILE | UFS_INLINE;
+            memset(inode->direct, 0, sizeof(inode->direct));
+            inode->size = 0;
+        } else {
+            while (get_bit(data_bitmap->bits, next_block) == 1) {
+                next_block++;
+            }
+            int dir_addr = next_block + s->data_region_addr;
+            set_bit(data_bitmap->bits, next_block++, 1);
+            dir_block_t *new_dir = (dir_block_t*) blocks[dir_addr];
+            strcpy(new_dir->entries[0].name, ".");
+            new_dir->entries[0].inum = inum;
+            strcpy(new_dir->entries[1].name, "..");
+            new_dir->entries[1].inum = pinum;
+            for (int e = 2; e < dir_slots; e++) {
+                new_dir->entries[e].inum = -1;
+            }
+            inode->type = UFS_DIRECTORY;
+            for (int b = 0; b < DIRECT_PTRS; b++) {
+                inode->direct[b] = -1;
+            }
+            inode->direct[0] = dir_addr;
+            inode->size = 2 * sizeof(dir_ent_t);
+        }
+        itable[pinum].size += sizeof(dir_ent_t);
+        write_end(inum);
+        inums[i] = inum;
+    }
+    for (int i = 0; i < n; i++) {
+        if (inums[i] <= -2) {
+            inums[i] = inums[-2 - inums[i]];
+        }
+    }
+    memcpy(response->buffer, inums, n * sizeof(int));
+    response->nbytes = n * sizeof(int);
+    free(inums);
+
+    // force write to disk, once for all of them
+    if (needed > 0) {
+        flush();
+    }
+
+    reply_success(response);
+}
+
+// 1 if inum is an allocated regular file
+int is_file(int inum) {
+    return inum >= 0 && inum < s->num_inodes && get_bit(inode_bitmap->bits, inum) == 1 &&
+        UFS_TYPE(itable[inum].type) == UFS_REGULAR_FILE;
+}
+
+void handle_copy(int pinum, char *name, int src, char *blocks[], message_t *response) {
+    if (!is_file(src)) {
+        err(response);
+        return;
+    }
+    // the copy needs a block for every one src has, holes stay holes
+    int need = 0;
+    for (int b = 0; b < DIRECT_PTRS && !(itable[src].type & UFS_INLINE); b++) {
+        need += itable[src].direct[b] != -1;
+    }
+    if (free_blocks(need) < need) {
+        err(response);
+        return;
+    }
+    dir_block_t *dir = dir_block(pinum, blocks);
+    if (dir == NULL) {
+        err(response);
+        return;
+    }
+    int slot = find_entry(dir, name);
+    if (slot != -1 && !is_file(dir->entries[slot].inum)) {
+        // won't replace a directory
+        err(response);
+        return;
+    }
+
+    // an existing file of that name is overwritten
+    handle_creat(pinum, UFS_REGULAR_FILE, name, blocks, response);
+    // by the entry, not response->rc, which a shm client can write
+    slot = find_entry(dir, name);
+    if (slot == -1) {
+        err(response);
+        return;
+    }
+    int inum = dir->entries[slot].inum;
+    response->inum = inum;
+    if (inum == src) {
+        return;
+    }
+
+    write_begin(inum);
+    inode_t *from = &itable[src];
+    inode_t *to = &itable[inum];
+    // the overwritten file's blocks go to the reclaimer, like an unlink's
+    int runs = pend_begin();
+    for (int b = 0; b < DIRECT_PTRS && !(to->type & UFS_INLINE); b++) {
+        int addr = (int)to->direct[b];
+        if (addr != -1 && valid_data_addr(addr)) {
+            pend_block(runs, addr);
+        }
+    }
+    to->type = from->type;
+    to->size = from->size;
+    if (from->type & UFS_INLINE) {
+        memcpy(to->direct, from->direct, sizeof(to->direct));
+    } else {
+        for (int b = 0; b < DIRECT_PTRS; b++) {
+            int addr = (int)from->direct[b];
+            if (addr == -1 || !valid_data_addr(addr)) {
+                to->direct[b] = -1;
+                continue;
+            }
+            int index = get_free_bit(data_bitmap->bits, s->num_data);
+            set_bit(data_bitmap->bits, index, 1);
+            to->direct[b] = index + s->data_region_addr;
+            memcpy(blocks[to->direct[b]], blocks[addr], block_size);
+        }
+    }
+    write_end(inum);
+
+    // force write to disk
+    flush();
+
+    reply_success(response);
+}
+
+void handle_copy_range(int inum, int offset, int src, int src_offset, int nbytes, char *blocks[], message_t *response) {
+    if (!is_file(inum) || !is_file(src)) {
+        err(response);
+        return;
+    }
+    // in long: the sums can overflow an int
+    if (src_offset < 0 || nbytes < 0 || (long)src_offset + nbytes > itable[src].size ||
+        offset < 0 || (long)offset + nbytes > (long)DIRECT_PTRS * block_size) {
+        err(response);
+        return;
+    }
+
+    // count the blocks the writes below will allocate, and check the
+    // source's pointers, so a copy that can't finish fails up front
+    inode_t *to = &itable[inum];
+    int first_block = offset / block_size;
+    int last_block = nbytes > 0 ? (offset + nbytes - 1) / block_size : first_block - 1;
+    int need = 0;
+    if (to->type & UFS_INLINE) {
+        if (offset + nbytes > UFS_INLINE_MAX) {
+            need = last_block - first_block + 1 + (to->size > 0 && first_block > 0);
+        }
+    } else {
+        for (int b = first_block; b <= last_block; b++) {
+            need += to->direct[b] == -1;
+        }
+    }
+    for (int b = 0; b < DIRECT_PTRS && !(itable[src].type & UFS_INLINE); b++) {
+        int addr = (int)itable[src].direct[b];
+        if (addr != -1 && !valid_data_addr(addr)) {
+            err(response);
+            return;
+        }
+    }
+    if (free_blocks(need) < need) {
+        err(response);
+        return;
+    }
+
+    // one source block at a time. within a file, copy back to front
+    // when the target overlaps the source further on, like memmove
+    static const char zeros[UFS_MAX_BLOCK_SIZE];
+    char bounce[UFS_MAX_BLOCK_SIZE];
+    int backward = src == inum && offset > src_offset && offset < src_offset + nbytes;
+    for (int done = 0; done < nbytes; ) {
+        int pos, len;
+        if (!backward) {
+            pos = done;
+            len = block_size - (src_offset + pos) % block_size;
+            if (len > nbytes - done) {
+                len = nbytes - done;
+            }
+        } else {
+            int end = nbytes - done;
+            pos = (src_offset + end - 1) / block_size * block_size - src_offset;
+            if (pos < 0) {
+                pos = 0;
+            }
+            len = end - pos;
+        }
+
+        // where the bytes are now: a write may have moved an inline file
+        inode_t *from = &itable[src];
+        int at = src_offset + pos;
+        char *data;
+        if (from->type & UFS_INLINE) {
+            data = (char*)from->direct + at;
+        } else if ((int)from->direct[at / block_size] == -1) {
+            data = (char*)zeros;
+        } else {
+            data = blocks[from->direct[at / block_size]] + at % block_size;
+        }
+        if (src == inum) {
+            memcpy(bounce, data, len);
+            data = bounce;
+        }
+        handle_write(inum, data, offset + pos, len, blocks, response);
+        if (response->rc < 0) {
+            return;
+        }
+        done += len;
+    }
+    reply_success(response);
+}
+
+void handle_unlink(int pinum, char *name, char *blocks[], message_t *response) {
+    // if pinum not valid, reply -1
+    if (pinum < 0 || pinum >= s->num_inodes) {
+        err(response);
+        return;
+    }
+    if (get_bit(inode_bitmap->bits, pinum) != 1) {
+        err(response);
+        return;
+    }
+
+    // if not a dir, reply -1
+    if (itable[pinum].type != UFS_DIRECTORY) {
+        err(response);
+        return;
+    }
+
+    int data_block_addr = (int)itable[pinum].direct[0];
+    if (data_block_addr == -1) {
+        err(response);
+        return;
+    }
+    int data_block_index = data_block_addr - s->data_region_addr;
+    // if data block not valid, reply -1
+    if (get_bit(data_bitmap->bits, data_block_index) != 1) {
+        err(response);
+        return;
+    }
+
+    dir_block_t *dir = (dir_block_t*)blocks[data_block_addr];
+
+    int dir_size = itable[pinum].size;
+    // if it's an empty dir, reply success
+    if (dir_size < sizeof(dir_ent_t)) {
+        reply_success(response);
+        return;
+    }
+
+    for (int i = 0; i < dir_slots; i++) {
+        if (dir->entries[i].inum == -1) {
+            continue;
+        }
+        if (strcmp(dir->entries[i].name, name) == 0) {
+            // file/dir found, unlink
+            int file_inum = dir->entries[i].inum;
+            int type = itable[file_inum].type;
+            int size = itable[file_inum].size;
+            if (type == UFS_DIRECTORY) {
+                if (size > 2 * sizeof(dir_ent_t)) {
+                    // dir not empty
+                    err(response);
+                    return;
+                }
+            }
+            write_begin(file_inum);
+            dir->entries[i].inum = -1;
+            itable[pinum].size -= sizeof(dir_ent_t);
+            release_inode(file_inum);
+            write_end(file_inum);
+
+            // force write to disk
+            flush();
+
+            reply_success(response);
             return;
         }
     }
 
     // file not found, reply success;
+    reply_success(response);
+}
+
+// extend the data region, the last thing in the image, to num_data
+// blocks while serving. the file grows first; the new blocks are there
+// once the super block says so
+void handle_grow(int num_data, message_t *response) {
+    long size = (long)(s->data_region_addr + num_data) * block_size;
+    if (num_data < s->num_data || num_data > max_data || size > map_size || size > 0x7fffffff) {
+        err(response);
+        return;
+    }
+    if (size > image_size && ftruncate(image_fd, size) < 0) {
+        perror("server:: can't grow the image");
+        err(response);
+        return;
+    }
+    for (int i = s->num_data; i < num_data; i++) {
+        set_bit(data_bitmap->bits, i, 0);
+    }
+    if (size > image_size) {
+        __atomic_store_n(&image_size, (int)size, __ATOMIC_RELEASE);
+    }
+    s->data_region_len = num_data;
+    __atomic_store_n(&s->num_data, num_data, __ATOMIC_RELEASE);
+
+    // force write to disk
+    flush();
+
+    reply_success(response);
+}
+
+// one batch of the pending list
+// runs is how many, 0 for a batch of RECLAIM_BATCH
+void handle_reclaim(int runs, message_t *response) {
+    reclaim(runs > 0 ? runs : RECLAIM_BATCH);
+    flush();
+    reply_success(response);
+}
+
+void usage() {
+    fprintf(stderr, "usage: server [-c] [-u] [-n loops] [-l socket] [-T] [-U socket] [-b backups [-q quorum] | -B]\n"
+        "              [-s stats-file [-i seconds]] [-t trace-file] [portnum] [file-system-image]\n"
+        "  -c  check (and repair) the image before serving it\n"
+        "  -u  run the event loop(s) on io_uring, if the kernel has it\n"
+        "  -n  serve the port from this many sockets/threads (SO_REUSEPORT), one per core\n"
+        "  -l  also serve same-host clients over shared memory, via this unix socket\n"
+        "      (MFS_Init(\"shm:<socket>\", 0))\n"
+        "  -T  also accept TCP connections on portnum (MFS_Init(\"tcp:<host>\", portnum))\n"
+        "  -U  also accept connections on this unix socket (MFS_Init(\"unix:<socket>\", 0))\n"
+        "  -b  replicate mutations to these backups (host:port,...), started from a copy\n"
+        "      of this image; clients are acked once -q of them (default all) applied it,\n"
+        "      and mutations fail while fewer than that are connected\n"
+        "  -B  run as a backup: serve reads, take mutations only from a primary (implies -T)\n"
+        "  -s  dump metrics as JSON to stats-file every -i seconds (default 10)\n"
+        "  -t  record every request to trace-file (see replay)\n");
+    exit(1);
+}
+
+void dump_stats() {
+    MFS_Stats_t stats;
+    collect_stats(&stats);
+    if (metrics_dump(&stats, stats_path) < 0) {
+        perror("server:: stats dump");
+    }
+}
+
+void trace_open(char *path) {
+    trace = fopen(path, "w");
+    if (trace == NULL) {
+        perror("server:: trace");
+        exit(1);
+    }
+    // records are small; let stdio batch them into big writes
+    setvbuf(trace, NULL, _IOFBF, 1 << 20);
+
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    trace_header_t header;
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.start_ns = wall.tv_sec * 1000000000ULL + wall.tv_nsec;
+    fwrite(&header, sizeof(header), 1, trace);
+    trace_start = now_ns();
+}
+
+void trace_request(message_t *request, message_t *response, unsigned long long received) {
+    trace_rec_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.ts_ns = received - trace_start;
+    rec.client_addr = sockaddr.sin_addr.s_addr;
+    rec.client_port = sockaddr.sin_port;
+    rec.mtype = request->mtype;
+    rec.rc = response->rc;
+    rec.inum = request->inum;
+    rec.offset = request->offset;
+    rec.nbytes = request->nbytes;
+    rec.type = request->type;
+    if (request->mtype == MFS_TRUNCATE) {
+        rec.offset = request->size;
+    }
+    if (request->mtype == MFS_APPEND) {
+        rec.offset = response->offset;
+    }
+    if ((request->mtype == MFS_LOOKUP || request->mtype == MFS_COPY) && response->rc == 0) {
+        rec.result = response->inum;
+    }
+    if (request->mtype == MFS_COPY_RANGE) {
+        rec.result = request->size;
+    }
+    memcpy(rec.name, request->name, sizeof(rec.name));
+    if (request->mtype == MFS_RENAME && request->nbytes > 0 && request->nbytes <= sizeof(rec.new_name)) {
+        memcpy(rec.new_name, request->buffer, request->nbytes);
+    }
+    pthread_mutex_lock(&trace_lock);
+    if (trace != NULL) {
+        fwrite(&rec, sizeof(rec), 1, trace);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int is_mutation(int mtype) {
+    return mtype == MFS_WRITE || mtype == MFS_CREAT || mtype == MFS_UNLINK || mtype == MFS_TRUNCATE ||
+        mtype == MFS_RENAME || mtype == MFS_APPEND || mtype == MFS_COPY || mtype == MFS_COPY_RANGE ||
+        mtype == MFS_CREAT_MANY || mtype == MFS_RECLAIM || mtype == MFS_GROW;
+}
+
+// reclaims and grows change no inode; the inum they carry is unused
+int changes_inode(int mtype) {
+    return is_mutation(mtype) && mtype != MFS_RECLAIM && mtype != MFS_GROW;
+}
+
+// capacity is how many bytes request->buffer and response->buffer hold:
+// MFS_BUFFER for a datagram, more on a stream
+void dispatch(message_t *request, message_t *response, int capacity, char *blocks[]) {
+    if ((request->mtype == MFS_READ || MFS_HAS_BODY(request->mtype)) && request->nbytes > capacity) {
+        err(response);
+        return;
+    }
+    if (is_mutation(request->mtype) && backup_mode && !replicating) {
+        // read only, the primary owns the image
+        err(response);
+        return;
+    }
+    if (backup_mode && !primary_linked && (request->mtype == MFS_LOOKUP || request->mtype == MFS_STAT ||
+        request->mtype == MFS_READ || request->mtype == MFS_STAT_MANY)) {
+        // what's here may be stale; the client asks the primary instead
+        response->rc = MFS_STALE;
+        return;
+    }
+    if (is_mutation(request->mtype) && backup_list != NULL && !repl_ready()) {
+        // it could never be acked by -q backups, so don't apply it
+        err(response);
+        return;
+    }
+    if (is_mutation(request->mtype)) {
+        // the inode the request names is the one it changes: the file for
+        // a write, truncate or ranged copy, the parent directory for the
+        // rest. the handler brackets the others itself
+        pthread_mutex_lock(&fs_lock);
+        if (changes_inode(request->mtype)) {
+            write_begin(request->inum);
+        }
+        reclaimed_runs = 0;
+    }
+
+    unsigned int seq;
+    switch (request->mtype) {
+
+        case MFS_LOOKUP:
+            do {
+                seq = read_begin(request->inum);
+                handle_lookup(request->inum, request->name, blocks, response);
+            } while (read_retry(request->inum, seq));
+            break;
+
+        case MFS_STAT:
+            do {
+                seq = read_begin(request->inum);
+                handle_stat(request->inum, blocks, response);
+            } while (read_retry(request->inum, seq));
+            break;
+
+        case MFS_WRITE:
+            handle_write(request->inum, request->buffer, request->offset, request->nbytes, blocks, response);
+            break;
+
+        case MFS_STAT_MANY:
+            // each inum becomes an MFS_Stat_t, twice its size
+            if (request->nbytes < 0 || request->nbytes % sizeof(int) != 0 ||
+                request->nbytes / sizeof(int) * sizeof(MFS_Stat_t) > capacity) {
+                err(response);
+                break;
+            }
+            handle_stat_many((int*)request->buffer, request->nbytes / sizeof(int), response);
+            break;
+
+        case MFS_CREAT_MANY:
+            if (request->nbytes < 0 || request->nbytes % sizeof(request->name) != 0) {
+                err(response);
+                break;
+            }
+            handle_creat_many(request->inum, request->type, request->buffer, request->nbytes / sizeof(request->name), blocks, response);
+            break;
+
+        case MFS_COPY:
+            handle_copy(request->inum, request->name, request->type, blocks, response);
+            break;
+
+        case MFS_COPY_RANGE:
+            handle_copy_range(request->inum, request->offset, request->type, request->size, request->nbytes, blocks, response);
+            break;
+
+        case MFS_APPEND:
+            handle_append(request->inum, request->buffer, request->nbytes, blocks, response);
+            break;
+
+        case MFS_READ:
+            do {
+                seq = read_begin(request->inum);
+                handle_read(request->inum, request->offset, request->nbytes, blocks, response);
+            } while (read_retry(request->inum, seq));
+            break;
+
+        case MFS_CREAT:
+            handle_creat(request->inum, request->type, request->name, blocks, response);
+            break;
+
+        case MFS_UNLINK:
+            handle_unlink(request->inum, request->name, blocks, response);
+            break;
+
+        case MFS_TRUNCATE:
+            handle_truncate(request->inum, request->size, blocks, response);
+            break;
+
+        case MFS_RENAME:
+            // the new name comes in the buffer
+            if (request->nbytes < 2 || request->nbytes > sizeof(request->name) || request->buffer[request->nbytes - 1] != '\0') {
+                err(response);
+                break;
+            }
+            handle_rename(request->inum, request->name, request->offset, request->buffer, blocks, response);
+            break;
+
+        case MFS_RECLAIM:
+            handle_reclaim(request->size, response);
+            break;
+
+        case MFS_GROW:
+            handle_grow(request->size, response);
+            break;
+
+        case MFS_STATS:
+            handle_stats(response);
+            break;
+
+        default:
+            err(response);
+            break;
+    }
+
+    if (is_mutation(request->mtype)) {
+        // ship under the lock, so backups apply in the same order. rc is
+        // read once, and put back so the reply says what was shipped: on
+        // shm the client can write the response
+        int rc = response->rc;
+        response->rc = rc;
+        unsigned long long lsn = 0;
+        if (backup_list != NULL && rc == 0) {
+            lsn = repl_ship(request);
+        } else if (backup_list != NULL && reclaimed_runs > 0) {
+            // failed, but only after reclaiming: the backups reclaim the
+            // same runs, or their bitmaps differ from here on
+            message_t batch;
+            memset(&batch, 0, offsetof(message_t, buffer));
+            batch.mtype = MFS_RECLAIM;
+            batch.size = reclaimed_runs;
+            repl_ship(&batch);
+        }
+        if (changes_inode(request->mtype)) {
+            write_end(request->inum);
+        }
+        pthread_mutex_unlock(&fs_lock);
+        if (lsn != 0 && defer_acks) {
+            awaiting_lsn = lsn;
+        } else if (lsn != 0 && repl_wait(lsn) < 0) {
+            // applied here, but the backups that took it are too few
+            response->rc = -1;
+        }
+    }
+}
+
+// dispatch for a datagram from sockaddr, answering retransmits of
+// appends, renames and range copies from the duplicate cache
+void dispatch_udp(message_t *request, message_t *response, char *blocks[]) {
+    if (request->mtype != MFS_APPEND && request->mtype != MFS_RENAME && request->mtype != MFS_COPY_RANGE) {
+        dispatch(request, response, MFS_BUFFER, blocks);
+        return;
+    }
+    unsigned int slot = (sockaddr.sin_addr.s_addr * 2654435761u ^ sockaddr.sin_port) % DUP_SLOTS;
+    dup_t *d = &dups[slot];
+
+    pthread_mutex_lock(&dups_lock);
+    int same = d->addr == sockaddr.sin_addr.s_addr && d->port == sockaddr.sin_port;
+    int hit = same && d->reply.seq == request->seq && d->reply.mtype == request->mtype;
+    int stale = same && !hit && (unsigned int)(d->reply.seq - request->seq) - 1 < DUP_WINDOW;
+    if (hit) {
+        memcpy(response, &d->reply, offsetof(message_t, buffer));
+        awaiting_lsn = defer_acks ? d->lsn : 0;
+    }
+    pthread_mutex_unlock(&dups_lock);
+    if (stale) {
+        err(response);
+        return;
+    }
+    if (hit) {
+        // the original may not be on disk (or the backups) yet; don't
+        // ack before it is
+        needs_flush = 1;
+        return;
+    }
+
+    dispatch(request, response, MFS_BUFFER, blocks);
+
+    pthread_mutex_lock(&dups_lock);
+    d->addr = sockaddr.sin_addr.s_addr;
+    d->port = sockaddr.sin_port;
+    memcpy(&d->reply, response, offsetof(message_t, buffer));
+    d->reply.seq = request->seq;
+    d->reply.mtype = request->mtype;
+    d->lsn = awaiting_lsn;
+    pthread_mutex_unlock(&dups_lock);
+}
+
+void shutdown_server(message_t *request, unsigned long long received) {
+    // wait out writes in flight on other loops, they never get it back
+    pthread_mutex_lock(&fs_lock);
+    msync(image, image_size, MS_SYNC);
+    if (trace != NULL) {
+        message_t response;
+        reply_success(&response);
+        trace_request(request, &response, received);
+        pthread_mutex_lock(&trace_lock);
+        fclose(trace);
+        trace = NULL;
+        pthread_mutex_unlock(&trace_lock);
+    }
+    if (stats_path != NULL) {
+        dump_stats();
+    }
+    for (int i = 0; i < nloops; i++) {
+        UDP_Close(loops[i].sd);
+    }
+    if (shm_path != NULL) {
+        unlink(shm_path);
+    }
+    if (unix_path != NULL) {
+        unlink(unix_path);
+    }
+    munmap(image, map_size);
+    close(image_fd);
+    exit(0);
+}
+
+// time the kernel held the request before we read it
+void record_queued(struct timespec *stamp) {
+    if (stamp->tv_sec == 0) {
+        return;
+    }
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    long long queued = (wall.tv_sec - stamp->tv_sec) * 1000000000LL + (wall.tv_nsec - stamp->tv_nsec);
+    if (queued > 0) {
+        hist_record(&metrics->phases[MFS_PHASE_QUEUE], queued);
+    }
+}
+
+// flushed is 0 if the request didn't need a flush
+void record_reply(int op, int rc, unsigned long long received, unsigned long long handled,
+    unsigned long long flushed, unsigned long long sent) {
+    if (flushed != 0) {
+        hist_record(&metrics->phases[MFS_PHASE_FLUSH], flushed - handled);
+    }
+    hist_record(&metrics->phases[MFS_PHASE_SEND], sent - (flushed != 0 ? flushed : handled));
+    hist_record(&metrics->ops[op], sent - received);
+    if (rc < 0) {
+        metrics->errors[op]++;
+    }
+}
+
+// io_uring loop (-u). one thread keeps a multishot receive, the replies
+// and a flush in flight and pays one syscall per batch of completions
+// rather than one per datagram. mutations are group committed: their
+// replies wait for the next fdatasync of the image, which covers every
+// mutation handled before it was submitted.
+
+#define URING_ENTRIES 256
+#define URING_BUFS    256
+#define URING_BGID    0
+
+// user_data of ops that aren't sends; sends carry their reply_t
+#define UD_RECV  1
+#define UD_FSYNC 2
+#define UD_TIMER 3
+#define UD_ACKS  4
+
+typedef struct reply {
+    struct reply *next;
     message_t response;
-    reply_success(&response);
+    struct sockaddr_in addr;
+    struct iovec iov;
+    struct msghdr msg;
+    int op;
+    unsigned long long received;
+    unsigned long long handled;
+    unsigned long long flushed;
+    unsigned long long lsn; // backups must ack this first, 0 if none
+} reply_t;
+
+__thread reply_t *free_replies;
+
+reply_t *reply_get() {
+    reply_t *r = free_replies;
+    if (r != NULL) {
+        free_replies = r->next;
+    } else {
+        r = malloc(sizeof(reply_t));
+        assert(r != NULL);
+    }
+    r->next = NULL;
+    r->flushed = 0;
+    r->lsn = 0;
+    return r;
+}
+
+void reply_put(reply_t *r) {
+    r->next = free_replies;
+    free_replies = r;
+}
+
+void uring_send(uring_t *ring, reply_t *r) {
+    r->iov.iov_base = &r->response;
+    r->iov.iov_len = sizeof(message_t);
+    memset(&r->msg, 0, sizeof(r->msg));
+    r->msg.msg_name = &r->addr;
+    r->msg.msg_namelen = sizeof(r->addr);
+    r->msg.msg_iov = &r->iov;
+    r->msg.msg_iovlen = 1;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    assert(sqe != NULL);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sd;
+    sqe->addr = (unsigned long)&r->msg;
+    sqe->len = 1;
+    sqe->user_data = (unsigned long)r;
+}
+
+void uring_recv(uring_t *ring, struct msghdr *msg) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    assert(sqe != NULL);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sd;
+    sqe->addr = (unsigned long)msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = UD_RECV;
+}
+
+void uring_fsync(uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    assert(sqe != NULL);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = image_fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = UD_FSYNC;
+}
+
+void uring_timer(uring_t *ring, struct __kernel_timespec *ts) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    assert(sqe != NULL);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)ts;
+    sqe->len = 1;
+    sqe->user_data = UD_TIMER;
+}
+
+void uring_read(uring_t *ring, int fd, unsigned long long *value, unsigned long long user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    assert(sqe != NULL);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)value;
+    sqe->len = sizeof(*value);
+    sqe->user_data = user_data;
+}
+
+// returns only if io_uring can't be used, before any request was read
+int serve_uring(loop_t *loop) {
+    uring_t ring;
+    if (uring_init(&ring, URING_ENTRIES) < 0) {
+        return -1;
+    }
+    int control_len = CMSG_SPACE(sizeof(struct timespec));
+    int buf_size = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + control_len + sizeof(message_t);
+    if (uring_setup_buffers(&ring, URING_BGID, URING_BUFS, buf_size) < 0) {
+        uring_exit(&ring);
+        return -1;
+    }
+
+    // multishot recvmsg only looks at the lengths
+    struct msghdr recv_msg;
+    memset(&recv_msg, 0, sizeof(recv_msg));
+    recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    recv_msg.msg_controllen = control_len;
+    uring_recv(&ring, &recv_msg);
+
+    int dumper = loop->id == 0 && stats_path != NULL;
+    struct __kernel_timespec tick = { 1, 0 };
+    unsigned long long next_dump = start_ns + stats_interval * 1000000000ULL;
+    if (dumper) {
+        uring_timer(&ring, &tick);
+    }
+
+    // with backups, replies also wait for their acks: repl_watch's
+    // eventfd wakes the loop to look, rather than blocking in dispatch
+    int ack_fd = -1;
+    unsigned long long acks;
+    if (backup_list != NULL) {
+        ack_fd = eventfd(0, EFD_NONBLOCK);
+        assert(ack_fd >= 0);
+        repl_watch(ack_fd);
+        uring_read(&ring, ack_fd, &acks, UD_ACKS);
+        defer_acks = 1;
+    }
+
+    reply_t *unflushed = NULL; // mutations no flush covers yet
+    reply_t *flushing = NULL;  // mutations the flush in flight covers
+    reply_t *unacked = NULL;   // flushed mutations the backups have yet to ack
+    int fsync_busy = 0;
+    long served = 0;
+
+    while (1) {
+        if (uring_submit(&ring, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("server:: io_uring_enter");
+            exit(1);
+        }
+
+        int rearm = 0;
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&ring)) != NULL) {
+            unsigned long long user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned int flags = cqe->flags;
+            uring_seen(&ring);
+
+            if (user_data == UD_TIMER) {
+                if (now_ns() >= next_dump) {
+                    dump_stats();
+                    next_dump = now_ns() + stats_interval * 1000000000ULL;
+                }
+                uring_timer(&ring, &tick);
+                continue;
+            }
+
+            if (user_data == UD_ACKS) {
+                // unacked is looked at below
+                uring_read(&ring, ack_fd, &acks, UD_ACKS);
+                continue;
+            }
+
+            if (user_data == UD_FSYNC) {
+                if (res < 0) {
+                    errno = -res;
+                    perror("server:: fdatasync");
+                }
+                unsigned long long flushed = now_ns();
+                while (flushing != NULL) {
+                    reply_t *r = flushing;
+                    flushing = r->next;
+                    r->flushed = flushed;
+                    if (r->lsn != 0) {
+                        r->next = unacked;
+                        unacked = r;
+                    } else {
+                        uring_send(&ring, r);
+                    }
+                }
+                fsync_busy = 0;
+                continue;
+            }
+
+            if (user_data != UD_RECV) {
+                reply_t *r = (reply_t*)user_data;
+                if (res < 0) {
+                    printf("server:: failed to send\n");
+                }
+                record_reply(r->op, r->response.rc, r->received, r->handled, r->flushed, now_ns());
+                reply_put(r);
+                continue;
+            }
+
+            if (!(flags & IORING_CQE_F_MORE)) {
+                rearm = 1;
+            }
+            if (res < 0) {
+                // no multishot recvmsg (before 6.0): use the plain loop
+                if (res == -EINVAL && served == 0) {
+                    uring_exit(&ring);
+                    return -1;
+                }
+                continue;
+            }
+            int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            char *buf = uring_buffer(&ring, bid);
+            struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out*)buf;
+            char *name = buf + sizeof(*out);
+            char *control = name + recv_msg.msg_namelen;
+            char *payload = control + recv_msg.msg_controllen;
+            if (res < (int)(payload - buf) || out->payloadlen == 0) {
+                uring_recycle(&ring, bid);
+                continue;
+            }
+
+            unsigned long long received = now_ns();
+            message_t request;
+            int len = out->payloadlen < sizeof(message_t) ? out->payloadlen : sizeof(message_t);
+            memcpy(&request, payload, len);
+            memcpy(&sockaddr, name, sizeof(struct sockaddr_in));
+
+            struct msghdr cmsgs;
+            memset(&cmsgs, 0, sizeof(cmsgs));
+            cmsgs.msg_control = control;
+            cmsgs.msg_controllen = out->controllen;
+            struct timespec stamp = { 0, 0 };
+            for (struct cmsghdr *c = CMSG_FIRSTHDR(&cmsgs); c != NULL; c = CMSG_NXTHDR(&cmsgs, c)) {
+                if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+                    memcpy(&stamp, CMSG_DATA(c), sizeof(stamp));
+                }
+            }
+            uring_recycle(&ring, bid);
+            record_queued(&stamp);
+            served++;
+
+            if (request.mtype == MFS_SHUTDOWN) {
+                // don't strand acknowledged-to-be mutations
+                msync(image, image_size, MS_SYNC);
+                reply_t *lists[3] = { flushing, unflushed, unacked };
+                for (int i = 0; i < 3; i++) {
+                    for (reply_t *r = lists[i]; r != NULL; r = r->next) {
+                        if (r->lsn != 0 && repl_wait(r->lsn) < 0) {
+                            r->response.rc = -1;
+                        }
+                        UDP_Write(sd, &r->addr, (char *) &r->response, sizeof(message_t));
+                    }
+                }
+                shutdown_server(&request, received);
+            }
+
+            // names are strcmp'd and strcpy'd, make sure they end
+            request.name[sizeof(request.name) - 1] = '\0';
+            reply_t *r = reply_get();
+            r->op = metrics_op(request.mtype);
+            r->addr = sockaddr;
+            r->received = received;
+            unsigned long long decoded = now_ns();
+
+            needs_flush = 0;
+            awaiting_lsn = 0;
+            dispatch_udp(&request, &r->response, loop->blocks);
+            r->response.seq = request.seq;
+            r->lsn = awaiting_lsn;
+            r->handled = now_ns();
+            hist_record(&metrics->phases[MFS_PHASE_DECODE], decoded - received);
+            hist_record(&metrics->phases[MFS_PHASE_HANDLER], r->handled - decoded);
+
+            if (trace != NULL) {
+                trace_request(&request, &r->response, received);
+            }
+
+            if (needs_flush) {
+                r->next = unflushed;
+                unflushed = r;
+            } else if (r->lsn != 0) {
+                r->next = unacked;
+                unacked = r;
+            } else {
+                uring_send(&ring, r);
+            }
+        }
+
+        // send what the backups have acked, or never will
+        reply_t **p = &unacked;
+        while (*p != NULL) {
+            reply_t *r = *p;
+            int acked = repl_acked(r->lsn);
+            if (acked == 0) {
+                p = &r->next;
+                continue;
+            }
+            *p = r->next;
+            if (acked < 0) {
+                r->response.rc = -1;
+            }
+            uring_send(&ring, r);
+        }
+
+        // everything handled so far rides on one flush
+        if (unflushed != NULL && !fsync_busy) {
+            flushing = unflushed;
+            unflushed = NULL;
+            fsync_busy = 1;
+            uring_fsync(&ring);
+        }
+        if (rearm) {
+            uring_recv(&ring, &recv_msg);
+        }
+    }
+}
+
+// fold a finished connection's counts into the totals and drop it
+void conn_close(conn_t *c) {
+    pthread_mutex_lock(&conns_lock);
+    conn_t **p = &conns;
+    while (*p != c) {
+        p = &(*p)->next;
+    }
+    *p = c->next;
+    metrics_merge(&conns_retired, &c->metrics);
+    pthread_mutex_unlock(&conns_lock);
+    if (c->chan != NULL) {
+        SHM_Close(c->fd, c->chan);
+    } else {
+        close(c->fd);
+    }
+    free(c);
+}
+
+// one thread per shm client. replies are written straight into the
+// channel, so a read is one copy from the image into memory the client
+// can see. requests are copied out first: the client can still write
+// the channel, and must not change a request after it has been checked
+void *serve_shm(void *arg) {
+    conn_t *c = (conn_t*)arg;
+    shm_chan_t *chan = c->chan;
+    metrics = &c->metrics;
+    sd = -1;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    char **blocks = loops[0].blocks;
+    message_t *request = malloc(sizeof(message_t));
+    assert(request != NULL);
+
+    while (1) {
+        if (SHM_Wait(chan, SHM_REQUEST, 100) != 0) {
+            if (SHM_Gone(c->fd)) {
+                break;
+            }
+            continue;
+        }
+        unsigned long long received = now_ns();
+        memcpy(request, &chan->request, offsetof(message_t, buffer));
+        if (MFS_HAS_BODY(request->mtype) && request->nbytes > 0) {
+            memcpy(request->buffer, chan->request.buffer, request->nbytes < MFS_BUFFER ? request->nbytes : MFS_BUFFER);
+        }
+
+        if (request->mtype == MFS_SHUTDOWN) {
+            shutdown_server(request, received);
+        }
+
+        // names are strcmp'd and strcpy'd, make sure they end
+        request->name[sizeof(request->name) - 1] = '\0';
+        int op = metrics_op(request->mtype);
+
+        needs_flush = 0;
+        dispatch(request, &chan->response, MFS_BUFFER, blocks);
+        chan->response.seq = request->seq;
+        unsigned long long handled = now_ns();
+
+        if (needs_flush) {
+            msync(image, image_size, MS_SYNC);
+        }
+        unsigned long long flushed = now_ns();
+
+        if (trace != NULL) {
+            trace_request(request, &chan->response, received);
+        }
+        int rc = chan->response.rc;
+        SHM_Post(chan, SHM_REPLY);
+        unsigned long long sent = now_ns();
+
+        hist_record(&metrics->phases[MFS_PHASE_HANDLER], handled - received);
+        record_reply(op, rc, received, handled, needs_flush ? flushed : 0, sent);
+    }
+
+    free(request);
+    conn_close(c);
+    return NULL;
+}
+
+// bytes of response->buffer that mean something, for transports that
+// don't send the whole message_t
+int reply_payload(message_t *request, message_t *response) {
+    if (response->rc < 0) {
+        return 0;
+    }
+    switch (request->mtype) {
+    case MFS_READ:
+        return request->nbytes;
+    case MFS_STAT_MANY:
+    case MFS_CREAT_MANY:
+        return response->nbytes;
+    case MFS_STATS:
+        return sizeof(MFS_Stats_t);
+    }
+    return 0;
+}
+
+// one thread per stream connection. frames carry the message head and
+// only the payload that's used, up to MFS_MAX_IO; reads and writes of
+// that size go straight between the socket buffers and the image
+void *serve_stream(void *arg) {
+    conn_t *c = (conn_t*)arg;
+    metrics = &c->metrics;
+    sd = -1;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    socklen_t len = sizeof(sockaddr);
+    getpeername(c->fd, (struct sockaddr *) &sockaddr, &len); // for the trace, TCP only
+    char **blocks = loops[0].blocks;
+
+    // message_t with room for MFS_MAX_IO bytes of buffer
+    int head = offsetof(message_t, buffer);
+    message_t *request = malloc(head + MFS_MAX_IO);
+    message_t *response = malloc(head + MFS_MAX_IO);
+    assert(request != NULL && response != NULL);
+
+    while (1) {
+        int body = STREAM_Recv(c->fd, (char *) request, head, request->buffer, MFS_MAX_IO);
+        if (body < 0) {
+            break;
+        }
+        unsigned long long received = now_ns();
+
+        if (request->mtype == MFS_SHUTDOWN) {
+            shutdown_server(request, received);
+        }
+        if (MFS_HAS_BODY(request->mtype) && request->nbytes > body) {
+            request->nbytes = -1; // claims more than it carries
+        }
+        if (request->mtype == MFS_REPLICATE) {
+            // a primary says hello; from now on its mutations apply here
+            replicating = backup_mode;
+            primary_linked = backup_mode;
+            response->rc = backup_mode ? 0 : -1;
+            response->seq = request->seq;
+            STREAM_Send(c->fd, (char *) response, head, NULL, 0);
+            continue;
+        }
+
+        // names are strcmp'd and strcpy'd, make sure they end
+        request->name[sizeof(request->name) - 1] = '\0';
+        int op = metrics_op(request->mtype);
+
+        needs_flush = 0;
+        dispatch(request, response, MFS_MAX_IO, blocks);
+        response->seq = request->seq;
+        unsigned long long handled = now_ns();
+
+        if (needs_flush) {
+            msync(image, image_size, MS_SYNC);
+        }
+        unsigned long long flushed = now_ns();
+
+        if (STREAM_Send(c->fd, (char *) response, head, response->buffer, reply_payload(request, response)) < 0) {
+            printf("server:: failed to send\n");
+        }
+        unsigned long long sent = now_ns();
+
+        if (trace != NULL) {
+            trace_request(request, response, received);
+        }
+        hist_record(&metrics->phases[MFS_PHASE_HANDLER], handled - received);
+        record_reply(op, response->rc, received, handled, needs_flush ? flushed : 0, sent);
+    }
+
+    if (replicating) {
+        fprintf(stderr, "server:: primary gone, no longer serving reads\n");
+        primary_linked = 0;
+    }
+    free(request);
+    free(response);
+    conn_close(c);
+    return NULL;
+}
+
+// accept connections on a listening socket, a thread for each. shm
+// says which transport: hand out a channel, or talk frames on a stream
+typedef struct {
+    int fd;
+    int shm;
+} listener_t;
+
+void *accept_conns(void *arg) {
+    listener_t *l = (listener_t*)arg;
+    while (1) {
+        shm_chan_t *chan = NULL;
+        int fd = l->shm ? SHM_Accept(l->fd, &chan) : STREAM_Accept(l->fd);
+        if (fd < 0) {
+            continue;
+        }
+        conn_t *c = calloc(1, sizeof(conn_t));
+        assert(c != NULL);
+        c->fd = fd;
+        c->chan = chan;
+        pthread_mutex_lock(&conns_lock);
+        c->next = conns;
+        conns = c;
+        pthread_mutex_unlock(&conns_lock);
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int rc = pthread_create(&thread, &attr, l->shm ? serve_shm : serve_stream, c);
+        assert(rc == 0);
+        pthread_attr_destroy(&attr);
+    }
+    return NULL;
+}
+
+void listen_conns(int fd, int shm) {
+    if (fd < 0) {
+        exit(1);
+    }
+    listener_t *l = malloc(sizeof(listener_t));
+    assert(l != NULL);
+    l->fd = fd;
+    l->shm = shm;
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, accept_conns, l);
+    assert(rc == 0);
+}
+
+void *serve(void *arg) {
+    loop_t *loop = (loop_t*)arg;
+    sd = loop->sd;
+    metrics = &loop->metrics;
+
+    if (nloops > 1) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(loop->id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    // loop 0 looks after the periodic stats dump
+    int dumper = loop->id == 0 && stats_path != NULL;
+    if (dumper) {
+        // wake up now and then so an idle server still dumps
+        struct timeval tv = { 1, 0 };
+        setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    unsigned long long next_dump = start_ns + stats_interval * 1000000000ULL;
+
+    if (use_uring && serve_uring(loop) < 0) {
+        fprintf(stderr, "server:: io_uring unavailable (%s), using recvfrom loop\n", strerror(errno));
+    }
+
+    while (1) {
+        if (dumper && now_ns() >= next_dump) {
+            dump_stats();
+            next_dump = now_ns() + stats_interval * 1000000000ULL;
+        }
+
+        message_t request;
+        struct timespec stamp;
+        // server:: waiting
+        int rc = UDP_ReadStamped(sd, &sockaddr, (char *) &request, sizeof(message_t), &stamp);
+
+        if (rc <= 0) {
+            continue;
+        }
+        unsigned long long received = now_ns();
+        record_queued(&stamp);
+
+        if (request.mtype == MFS_SHUTDOWN) {
+            shutdown_server(&request, received);
+        }
+
+        // names are strcmp'd and strcpy'd, make sure they end
+        request.name[sizeof(request.name) - 1] = '\0';
+        int op = metrics_op(request.mtype);
+        unsigned long long decoded = now_ns();
+
+        message_t response;
+        needs_flush = 0;
+        dispatch_udp(&request, &response, loop->blocks);
+        response.seq = request.seq;
+        unsigned long long handled = now_ns();
+
+        if (needs_flush) {
+            msync(image, image_size, MS_SYNC);
+        }
+        unsigned long long flushed = now_ns();
+
+        rc = UDP_Write(sd, &sockaddr, (char *) &response, sizeof(message_t));
+        if (rc < 0) {
+            printf("server:: failed to send\n");
+        }
+        unsigned long long sent = now_ns();
+
+        if (trace != NULL) {
+            trace_request(&request, &response, received);
+        }
+
+        hist_record(&metrics->phases[MFS_PHASE_DECODE], decoded - received);
+        hist_record(&metrics->phases[MFS_PHASE_HANDLER], handled - decoded);
+        record_reply(op, response.rc, received, handled, needs_flush ? flushed : 0, sent);
+    }
+    return NULL;
 }
 
 // server code
+// frees pending blocks in the background. a batch goes through dispatch
+// like any mutation, so backups are sent it at the same point in their
+// order and allocate the same blocks; they leave it to the primary
+void *reclaimer(void *arg) {
+    loop_t *loop = (loop_t*)arg;
+    while (1) {
+        usleep(RECLAIM_MS * 1000);
+        while (__atomic_load_n(&pending->num_runs, __ATOMIC_RELAXED) > 0) {
+            message_t request, response;
+            memset(&request, 0, offsetof(message_t, buffer));
+            request.mtype = MFS_RECLAIM;
+            dispatch(&request, &response, 0, loop->blocks);
+            if (needs_flush) {
+                msync(image, image_size, MS_SYNC);
+                needs_flush = 0;
+            }
+        }
+    }
+    return NULL;
+}
+
 int main(int argc, char *argv[]) {
-    if(argc != 3) {
-        fprintf(stderr, "usage: server [portnum] [file-system-image]\n");
-        exit(1);
+    int ch;
+    int check = 0;
+    int tcp = 0;
+    int quorum = 0;
+    char *trace_path = NULL;
+    while ((ch = getopt(argc, argv, "cs:i:t:n:ul:TU:b:q:B")) != -1) {
+        switch (ch) {
+        case 'c':
+            check = 1;
+            break;
+        case 's':
+            stats_path = optarg;
+            break;
+        case 'i':
+            stats_interval = atoi(optarg);
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'n':
+            nloops = atoi(optarg);
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'l':
+            shm_path = optarg;
+            break;
+        case 'T':
+            tcp = 1;
+            break;
+        case 'U':
+            unix_path = optarg;
+            break;
+        case 'b':
+            backup_list = optarg;
+            break;
+        case 'q':
+            quorum = atoi(optarg);
+            break;
+        case 'B':
+            backup_mode = 1;
+            tcp = 1; // the primary's link comes in over TCP
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if(argc != 2 || stats_interval <= 0 || nloops < 1 || (backup_list != NULL && backup_mode)) {
+        usage();
     }
-    int fd = open(argv[2], O_RDWR);
+    int fd = open(argv[1], O_RDWR);
     if(fd < 0) {
         fprintf(stderr, "image does not exist\n");
         exit(1);
     }
+    image_fd = fd;
 
     struct stat sbuf;
     int rc = fstat(fd, &sbuf);
@@ -600,74 +2549,107 @@ int main(int argc, char *argv[]) {
 
     image_size = (int) sbuf.st_size;
 
-    image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // map room for all the data blocks the bitmap has bits for. pages
+    // past the end of the file aren't touched until it has grown
+    super_t sb;
+    if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+        fprintf(stderr, "image is corrupt\n");
+        exit(1);
+    }
+    block_size = UFS_BLOCK_SIZE_OF(&sb);
+    if (!UFS_VALID_BLOCK_SIZE(block_size)) {
+        fprintf(stderr, "image has an unsupported block size (%d)\n", block_size);
+        exit(1);
+    }
+    dir_slots = block_size / sizeof(dir_ent_t);
+    max_data = sb.data_bitmap_len * block_size * 8;
+    map_size = (long)(sb.data_region_addr + max_data) * block_size;
+    if (map_size < image_size) {
+        map_size = image_size;
+    }
+    image = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     assert(image != MAP_FAILED);
 
     s = (super_t*) image;
 
-    int total_blocks = 1 + s->inode_bitmap_len + s->data_bitmap_len + s->inode_region_len + s->data_region_len;
+    if (check) {
+        fsck_result_t result;
+        long problems = fsck_image(image, image_size, sysconf(_SC_NPROCESSORS_ONLN), 1, 1, &result);
+        if (problems < 0) {
+            fprintf(stderr, "image is corrupt\n");
+            exit(1);
+        }
+        if (problems > 0) {
+            fprintf(stderr, "server:: repaired %ld problem(s) in image\n", problems);
+            msync(image, image_size, MS_SYNC);
+        }
+    }
+
+    int total_blocks = map_size / block_size;
 
-    // pointers to all blocks
-    char *blocks[total_blocks];
+    // pointers to all blocks, those the image may grow into included
+    char **blocks = malloc(total_blocks * sizeof(char*));
+    assert(blocks != NULL);
     for (int i = 0; i < total_blocks; i++) {
-        blocks[i] = (char*)image + i * UFS_BLOCK_SIZE;
+        blocks[i] = (char*)image + (long)i * block_size;
     }
     // assign pointers
     inode_bitmap = (bitmap_t*) blocks[s->inode_bitmap_addr];
     data_bitmap = (bitmap_t*) blocks[s->data_bitmap_addr];
     itable = (inode_t*) blocks[s->inode_region_addr];
+    pending = UFS_PENDING(image);
+    if (pending->num_runs < 0 || pending->num_runs > UFS_PENDING_RUNS) {
+        // not a list this server wrote; what it would have freed leaks
+        fprintf(stderr, "server:: ignoring a bad pending list (run with -c to reclaim)\n");
+        pending->num_runs = 0;
+    }
 
     signal(SIGINT, intHandler);
-    
-    int port = atoi(argv[1]);
-    sd = UDP_Open(port);
-    assert(sd > -1);
-
-    while (1) {
-        message_t request;
-        // server:: waiting
-        int rc = UDP_Read(sd, &sockaddr, (char *) &request, sizeof(message_t));
-
-        if (rc <= 0) {
-            continue;
-        }
-        switch (request.mtype) {
-
-            case MFS_LOOKUP:
-                handle_lookup(request.inum, request.name, blocks);
-                break;
-                
-            case MFS_STAT:
-                handle_stat(request.inum, blocks);
-                break;
-
-            case MFS_WRITE:
-                handle_write(request.inum, request.buffer, request.offset, request.nbytes, blocks);
-                break;
-
-            case MFS_READ:
-                handle_read(request.inum, request.offset, request.nbytes, blocks);
-                break;
+    signal(SIGTERM, intHandler);
+
+    inode_seq = calloc(s->num_inodes, sizeof(unsigned int));
+    dups = calloc(DUP_SLOTS, sizeof(dup_t));
+    assert(inode_seq != NULL);
+
+    int port = atoi(argv[0]);
+    loops = calloc(nloops, sizeof(loop_t));
+    assert(loops != NULL);
+    for (int i = 0; i < nloops; i++) {
+        loops[i].id = i;
+        loops[i].blocks = blocks;
+        loops[i].sd = nloops > 1 ? UDP_OpenShared(port) : UDP_Open(port);
+        assert(loops[i].sd > -1);
+        UDP_EnableStamps(loops[i].sd);
+    }
 
-            case MFS_CREAT:
-                handle_creat(request.inum, request.type, request.name, blocks);
-                break;
+    start_ns = now_ns();
+    if (trace_path != NULL) {
+        trace_open(trace_path);
+    }
 
-            case MFS_UNLINK:
-                handle_unlink(request.inum, request.name, blocks);
-                break;
-            
-            case MFS_SHUTDOWN:
-                UDP_Close(sd);
-                munmap(image, image_size);
-                close(fd);
-                exit(0);
-                break;
+    if (backup_list != NULL && repl_connect(backup_list, quorum) < 0) {
+        exit(1);
+    }
+    if (shm_path != NULL) {
+        listen_conns(SHM_Listen(shm_path), 1);
+    }
+    if (tcp) {
+        listen_conns(STREAM_ListenTCP(port), 0);
+    }
+    if (unix_path != NULL) {
+        listen_conns(STREAM_ListenUnix(unix_path), 0);
+    }
 
-            default:
-                err();
-                break;
-        }
+    if (!backup_mode) {
+        pthread_t thread;
+        rc = pthread_create(&thread, NULL, reclaimer, &loops[0]);
+        assert(rc == 0);
+    }
+    for (int i = 1; i < nloops; i++) {
+        pthread_t thread;
+        rc = pthread_create(&thread, NULL, serve, &loops[i]);
+        assert(rc == 0);
     }
+    serve(&loops[0]);
     return 0; 
-}
\ No newline at end of file
+}
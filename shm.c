@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "shm.h"
+
+// how long a waiter spins before it sleeps. spinning only pays when the
+// other side is running on another core at the same time
+#define SPIN_NS 20000
+
+static int spin_ns = -1;
+
+static unsigned long long clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int fill_addr(struct sockaddr_un *addr, char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int SHM_Listen(char *path) {
+    struct sockaddr_un addr;
+    if (fill_addr(&addr, path) < 0) {
+        perror("shm: listen");
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("shm: socket");
+        return -1;
+    }
+    unlink(path); // left over from a server that didn't shut down
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        perror("shm: bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// accept a client, hand it a fresh channel; returns the connection
+int SHM_Accept(int ld, shm_chan_t **chan) {
+    int fd = accept(ld, NULL, NULL);
+    if (fd < 0) {
+        return -1;
+    }
+    int mfd = memfd_create("mfs-shm", MFD_CLOEXEC);
+    if (mfd < 0 || ftruncate(mfd, sizeof(shm_chan_t)) < 0) {
+        perror("shm: memfd");
+        goto fail;
+    }
+    *chan = mmap(NULL, sizeof(shm_chan_t), PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    if (*chan == MAP_FAILED) {
+        perror("shm: mmap");
+        goto fail;
+    }
+
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &mfd, sizeof(int));
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+        munmap(*chan, sizeof(shm_chan_t));
+        goto fail;
+    }
+    close(mfd);
+    return fd;
+
+fail:
+    if (mfd >= 0) {
+        close(mfd);
+    }
+    close(fd);
+    return -1;
+}
+
+int SHM_Connect(char *path, shm_chan_t **chan) {
+    struct sockaddr_un addr;
+    if (fill_addr(&addr, path) < 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *c;
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1 || (c = CMSG_FIRSTHDR(&msg)) == NULL || c->cmsg_type != SCM_RIGHTS) {
+        close(fd);
+        return -1;
+    }
+    int mfd;
+    memcpy(&mfd, CMSG_DATA(c), sizeof(int));
+    *chan = mmap(NULL, sizeof(shm_chan_t), PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    close(mfd);
+    if (*chan == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void SHM_Post(shm_chan_t *chan, unsigned int state) {
+    __atomic_store_n(&chan->state, state, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&chan->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, &chan->state, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+int SHM_Wait(shm_chan_t *chan, unsigned int state, int timeout_ms) {
+    if (spin_ns < 0) {
+        spin_ns = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_NS : 0;
+    }
+    unsigned long long start = clock_ns();
+    unsigned long long deadline = start + timeout_ms * 1000000ULL;
+
+    for (int i = 0; spin_ns > 0; i++) {
+        if (__atomic_load_n(&chan->state, __ATOMIC_ACQUIRE) == state) {
+            return 0;
+        }
+        if (i % 64 == 63 && clock_ns() - start > spin_ns) {
+            break;
+        }
+    }
+
+    while (1) {
+        __atomic_fetch_add(&chan->sleepers, 1, __ATOMIC_SEQ_CST);
+        unsigned int seen = __atomic_load_n(&chan->state, __ATOMIC_SEQ_CST);
+        if (seen != state) {
+            unsigned long long now = clock_ns();
+            if (now >= deadline) {
+                __atomic_fetch_sub(&chan->sleepers, 1, __ATOMIC_SEQ_CST);
+                return 1;
+            }
+            struct timespec ts = { (deadline - now) / 1000000000ULL, (deadline - now) % 1000000000ULL };
+            syscall(SYS_futex, &chan->state, FUTEX_WAIT, seen, &ts, NULL, 0);
+        }
+        __atomic_fetch_sub(&chan->sleepers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&chan->state, __ATOMIC_ACQUIRE) == state) {
+            return 0;
+        }
+    }
+}
+
+int SHM_Gone(int fd) {
+    struct pollfd p = { fd, POLLIN | POLLRDHUP, 0 };
+    return poll(&p, 1, 0) > 0 && (p.revents & (POLLHUP | POLLRDHUP | POLLERR));
+}
+
+int SHM_Close(int fd, shm_chan_t *chan) {
+    munmap(chan, sizeof(shm_chan_t));
+    return close(fd);
+}
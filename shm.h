@@ -0,0 +1,45 @@
+#ifndef __SHM_h__
+#define __SHM_h__
+
+#include "mfs.h"
+
+// shared memory transport for clients on the same host as the server.
+//
+// the client connects to the server's unix socket (server -l) and gets
+// back a memfd holding one shm_chan_t, which both sides map. a call is
+// then: client fills in request, posts SHM_REQUEST; server handles it
+// straight out of and into the mapping, posts SHM_REPLY. the socket
+// stays open only so each side notices when the other goes away.
+//
+// MFS calls are synchronous, one outstanding per thread, so a channel
+// holds exactly one request and one reply rather than a deeper ring.
+
+#define SHM_IDLE    0
+#define SHM_REQUEST 1
+#define SHM_REPLY   2
+
+typedef struct {
+    unsigned int state;    // SHM_*, also the futex word
+    unsigned int sleepers; // waiters in futex_wait, so posts skip the wake
+    char pad[56];          // keep request off the state's cache line
+    message_t request;
+    message_t response;
+} shm_chan_t;
+
+// server side
+int SHM_Listen(char *path);
+int SHM_Accept(int ld, shm_chan_t **chan);
+
+// client side, returns the socket and maps the channel
+int SHM_Connect(char *path, shm_chan_t **chan);
+
+void SHM_Post(shm_chan_t *chan, unsigned int state);
+// wait for chan->state to become state; spins briefly before sleeping.
+// 0 once it does, 1 on timeout
+int SHM_Wait(shm_chan_t *chan, unsigned int state, int timeout_ms);
+// 1 if the other end of the socket has gone away
+int SHM_Gone(int fd);
+
+int SHM_Close(int fd, shm_chan_t *chan);
+
+#endif // __SHM_h__
@@ -0,0 +1,34 @@
+#ifndef __trace_h__
+#define __trace_h__
+
+// binary request trace written by server -t and read by replay.
+// a trace is one trace_header_t followed by fixed size records, all in
+// host byte order.
+
+#define TRACE_MAGIC   (0x5453464d) // "MFST"
+#define TRACE_VERSION (2)
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long start_ns; // wall clock time of the first record
+} trace_header_t;
+
+typedef struct {
+    unsigned long long ts_ns;   // receive time, relative to start_ns
+    unsigned int client_addr;   // IPv4 address, network byte order
+    unsigned short client_port; // network byte order
+    unsigned char mtype;
+    signed char rc;             // what the server replied
+    int inum;
+    int offset;                 // new size for a truncate, new parent for a rename,
+                                // where an append went
+    int nbytes;
+    int type;
+    int result;                 // inum a lookup or copy returned, source
+                                // offset of a ranged copy, else 0
+    char name[28];
+    char new_name[28];          // rename only
+} trace_rec_t;
+
+#endif // __trace_h__
@@ -1,14 +1,21 @@
 #include "udp.h"
 
-// create a socket and bind it to a port on the current machine
-// used to listen for incoming packets
-int UDP_Open(int port) {
+int udp_open(int port, int shared) {
     int fd;           
     if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
 	perror("socket");
 	return 0;
     }
 
+    if (shared) {
+	int on = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+	    perror("setsockopt");
+	    close(fd);
+	    return -1;
+	}
+    }
+
     // set up the bind
     struct sockaddr_in my_addr;
     bzero(&my_addr, sizeof(my_addr));
@@ -26,6 +33,16 @@ int UDP_Open(int port) {
     return fd;
 }
 
+// create a socket and bind it to a port on the current machine
+// used to listen for incoming packets
+int UDP_Open(int port) {
+    return udp_open(port, 0);
+}
+
+int UDP_OpenShared(int port) {
+    return udp_open(port, 1);
+}
+
 // fill sockaddr_in struct with proper goodies
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostname, int port) {
     bzero(addr, sizeof(struct sockaddr_in));
@@ -61,6 +78,198 @@ int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n) {
     return rc;
 }
 
+int UDP_EnableStamps(int fd) {
+    int on = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+}
+
+int UDP_ReadStamped(int fd, struct sockaddr_in *addr, char *buffer, int n, struct timespec *stamp) {
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = n;
+
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    bzero(stamp, sizeof(struct timespec));
+    int rc = recvmsg(fd, &msg, 0);
+    if (rc < 0) {
+        return rc;
+    }
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(stamp, CMSG_DATA(c), sizeof(struct timespec));
+        }
+    }
+    return rc;
+}
+
 int UDP_Close(int fd) {
     return close(fd);
 }
+
+// stream transports (TCP, unix sockets). a frame is a 4 byte length in
+// network byte order, then a fixed size head, then a body of up to the
+// rest of the length.
+
+int stream_listen(int fd, struct sockaddr *addr, int addr_len) {
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, addr, addr_len) == -1 || listen(fd, 64) == -1) {
+	perror("bind");
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+int STREAM_ListenTCP(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+	perror("socket");
+	return -1;
+    }
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    return stream_listen(fd, (struct sockaddr *) &addr, sizeof(addr));
+}
+
+int STREAM_ListenUnix(char *path) {
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "socket path too long: %s\n", path);
+	return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+	perror("socket");
+	return -1;
+    }
+    unlink(path); // left over from a server that didn't shut down
+    return stream_listen(fd, (struct sockaddr *) &addr, sizeof(addr));
+}
+
+int STREAM_Accept(int fd) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn >= 0) {
+	int on = 1;
+	setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // fails harmlessly on unix sockets
+    }
+    return conn;
+}
+
+int STREAM_ConnectTCP(char *hostname, int port) {
+    struct sockaddr_in addr;
+    if (UDP_FillSockAddr(&addr, hostname, port) < 0) {
+	return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+	return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+	close(fd);
+	return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+int STREAM_ConnectUnix(char *path) {
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+	return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+// read exactly n bytes; -1 on error or if the peer went away
+int stream_read_full(int fd, char *buffer, int n) {
+    int done = 0;
+    while (done < n) {
+	int rc = read(fd, buffer + done, n - done);
+	if (rc < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (rc <= 0) {
+	    return -1;
+	}
+	done += rc;
+    }
+    return 0;
+}
+
+int STREAM_Send(int fd, char *head, int head_len, char *body, int body_len) {
+    unsigned int len = htonl(head_len + body_len);
+    struct iovec iov[3] = {
+	{ &len, sizeof(len) },
+	{ head, head_len },
+	{ body, body_len },
+    };
+    struct iovec *v = iov;
+    int count = body_len > 0 ? 3 : 2;
+    while (count > 0) {
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = v;
+	msg.msg_iovlen = count;
+	ssize_t rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	if (rc < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (rc < 0) {
+	    return -1;
+	}
+	// short write: skip what went out
+	while (count > 0 && rc >= (ssize_t) v->iov_len) {
+	    rc -= v->iov_len;
+	    v++;
+	    count--;
+	}
+	if (count > 0) {
+	    v->iov_base = (char *) v->iov_base + rc;
+	    v->iov_len -= rc;
+	}
+    }
+    return 0;
+}
+
+int STREAM_Recv(int fd, char *head, int head_len, char *body, int body_max) {
+    unsigned int len;
+    if (stream_read_full(fd, (char *) &len, sizeof(len)) < 0) {
+	return -1;
+    }
+    len = ntohl(len);
+    if (len < head_len || len - head_len > body_max) {
+	return -1; // not a frame we can take, the stream is out of sync
+    }
+    if (stream_read_full(fd, head, head_len) < 0 || stream_read_full(fd, body, len - head_len) < 0) {
+	return -1;
+    }
+    return len - head_len;
+}
@@ -20,19 +20,42 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
+#include <sys/un.h>
+#include <sys/uio.h>
+
 #include <netinet/tcp.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 
 //
 // prototypes
 // 
 
 int UDP_Open(int port);
+// like UDP_Open, but any number of sockets may bind the same port; the
+// kernel spreads incoming clients across them (SO_REUSEPORT)
+int UDP_OpenShared(int port);
 int UDP_Close(int fd);
 
 int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n);
 int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n);
 
+// like UDP_Read, but also returns when the kernel received the packet
+// (needs UDP_EnableStamps on the socket; stamp is zeroed otherwise)
+int UDP_EnableStamps(int fd);
+int UDP_ReadStamped(int fd, struct sockaddr_in *addr, char *buffer, int n, struct timespec *stamp);
+
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostName, int port);
 
+// stream sockets (TCP, unix) with length-prefixed frames: a fixed size
+// head followed by a variable size body. STREAM_Recv returns the body
+// length, or -1 if the peer went away or sent something too long.
+int STREAM_ListenTCP(int port);
+int STREAM_ListenUnix(char *path);
+int STREAM_Accept(int fd);
+int STREAM_ConnectTCP(char *hostName, int port);
+int STREAM_ConnectUnix(char *path);
+int STREAM_Send(int fd, char *head, int head_len, char *body, int body_len);
+int STREAM_Recv(int fd, char *head, int head_len, char *body, int body_max);
+
 #endif // __UDP_h__
\ No newline at end of file
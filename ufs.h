@@ -4,7 +4,20 @@
 #define UFS_DIRECTORY (0)
 #define UFS_REGULAR_FILE (1)
 
+// set in a regular file's type while its contents (at most UFS_INLINE_MAX
+// bytes) are kept in direct[] itself rather than in data blocks. the
+// first write past UFS_INLINE_MAX moves them out to a block.
+#define UFS_INLINE (0x100)
+#define UFS_TYPE(t) ((t) & ~UFS_INLINE)
+
+// the block size an image was made with (mkfs -b) is in its super
+// block. images from before that was recorded have 0 there and use
+// UFS_BLOCK_SIZE, which is also the smallest allowed: the super block
+// and pending list have to fit in block 0
 #define UFS_BLOCK_SIZE (4096)
+#define UFS_MAX_BLOCK_SIZE (65536)
+#define UFS_VALID_BLOCK_SIZE(b) ((b) >= UFS_BLOCK_SIZE && (b) <= UFS_MAX_BLOCK_SIZE && ((b) & ((b) - 1)) == 0)
+#define UFS_BLOCK_SIZE_OF(sb) ((sb)->block_size == 0 ? UFS_BLOCK_SIZE : (sb)->block_size)
 
 #define DIRECT_PTRS (30)
 
@@ -14,6 +27,9 @@ typedef struct {
     unsigned int direct[DIRECT_PTRS];
 } inode_t;
 
+#define UFS_INLINE_MAX ((int)sizeof(((inode_t*)0)->direct))
+
+// a directory's entries fill its one block (direct[0])
 typedef struct {
     char name[28];  // up to 28 bytes of name in directory (including \0)
     int  inum;      // inode number of entry (-1 means entry not used)
@@ -31,7 +47,27 @@ typedef struct __super {
     int data_region_len;   // in blocks
     int num_inodes;        // just the number of inodes
     int num_data;          // and data blocks...
+    int block_size;        // in bytes, 0 for UFS_BLOCK_SIZE
 } super_t;
 
+// blocks freed by unlinks and truncates, not yet given back to the data
+// bitmap. they stay marked until a background pass clears them (and
+// punches them out of the image file) in a batch. the list
+// lives in block 0 after the super block, so a restart picks up where
+// it left off; older images have zeros there, an empty list.
+typedef struct {
+    int start; // block address
+    int len;   // in blocks
+} ufs_run_t;
+
+#define UFS_PENDING_RUNS ((int)((UFS_BLOCK_SIZE - sizeof(super_t) - sizeof(int)) / sizeof(ufs_run_t)))
+
+typedef struct {
+    int num_runs;
+    ufs_run_t runs[UFS_PENDING_RUNS];
+} ufs_pending_t;
+
+#define UFS_PENDING(image) ((ufs_pending_t*)((char*)(image) + sizeof(super_t)))
+
 
 #endif // __ufs_h__
\ No newline at end of file
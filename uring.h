@@ -0,0 +1,61 @@
+#ifndef __URING_h__
+#define __URING_h__
+
+#include <linux/io_uring.h>
+
+// a thin wrapper around the raw io_uring syscalls, just enough for the
+// server's event loop: one submission and one completion queue, plus a
+// ring of provided buffers that multishot receives pick from.
+
+typedef struct {
+    int fd;
+
+    // submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail; // prepared but not yet handed to the kernel
+    unsigned to_submit;
+
+    // completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_len;
+    size_t cq_ring_len;
+    size_t sqes_len;
+
+    // provided buffers, group bgid
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    int bgid;
+    int nbufs;
+    int buf_size;
+    char *bufs;
+} uring_t;
+
+// returns -1 (errno set) if the kernel has no io_uring, or it's disabled
+int uring_init(uring_t *ring, unsigned entries);
+void uring_exit(uring_t *ring);
+
+// a zeroed sqe to fill in; submits what's queued if the ring is full
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+// hand queued sqes to the kernel and wait for at least wait completions
+int uring_submit(uring_t *ring, unsigned wait);
+
+// next completion or NULL; uring_seen releases it
+struct io_uring_cqe *uring_peek(uring_t *ring);
+void uring_seen(uring_t *ring);
+
+// count buffers of size bytes each, handed out to ops with IOSQE_BUFFER_SELECT
+int uring_setup_buffers(uring_t *ring, int bgid, int count, int size);
+char *uring_buffer(uring_t *ring, int bid);
+void uring_recycle(uring_t *ring, int bid);
+
+#endif // __URING_h__